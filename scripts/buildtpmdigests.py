@@ -0,0 +1,59 @@
+#!/usr/bin/env python
+# Generate the digests of the constant TPM measurement events
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, hashlib, optparse
+
+HEADER_FORMAT = """
+/* DO NOT EDIT!  This is an autogenerated file.  See scripts/buildtpmdigests.py. */
+static const struct tpm_const_digest tpm_const_digests[] = {
+%s};
+"""
+
+# Data of the events that src/tcgbios.c measures with the same contents
+# on every boot.  Other event data is hashed at runtime.
+CONST_EVENTS = [
+    # tpm_add_action() strings
+    b"Start Option ROM Scan",
+    b"Calling INT 19h",
+    b"Booting BCV device 00h (Floppy)",
+    b"Booting BCV device 80h (HDD)",
+    b"Booting from CD ROM device",
+    # tpm_add_event_separators()
+    b"\xff\xff\xff\xff",
+]
+
+def c_bytes(data):
+    return "{" + ",".join(["0x%02x" % (c,) for c in bytearray(data)]) + "}"
+
+def c_string(data):
+    out = ""
+    for c in bytearray(data):
+        if c >= 0x20 and c < 0x7f and c not in (ord('"'), ord('\\')):
+            out += chr(c)
+        else:
+            out += "\\x%02x" % (c,)
+    return '"' + out + '"'
+
+def main():
+    opts = optparse.OptionParser("%prog [options] <outputheader>")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect arguments")
+    outfile = args[0]
+
+    entries = ""
+    for data in CONST_EVENTS:
+        entries += "    {\n        .data = %s,\n        .length = %d,\n" % (
+            c_string(data), len(data))
+        for alg in ('sha1', 'sha256', 'sha384', 'sha512'):
+            digest = hashlib.new(alg, data).digest()
+            entries += "        .digests.%s = %s,\n" % (alg, c_bytes(digest))
+        entries += "    },\n"
+
+    f = open(outfile, 'w')
+    f.write(HEADER_FORMAT % (entries,))
+    f.close()
+
+if __name__ == '__main__':
+    main()
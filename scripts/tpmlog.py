@@ -0,0 +1,300 @@
+#!/usr/bin/env python
+# Script to replay a TCG event log written by SeaBIOS and predict (or
+# verify) the PCR values it results in.
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+
+# Usage:
+#   scripts/tpmlog.py binary_bios_measurements
+#   scripts/tpmlog.py -p pcrs.txt binary_bios_measurements
+#   scripts/tpmlog.py -j 8 --pcrs-ext .pcrs logs/*.bin
+#
+# Logs may be in the TPM 1.2 layout (struct pcpes) or in the crypto
+# agile layout that starts with a "Spec ID Event03" event.  PCR dumps
+# may be in the format of "tpm2_pcrread", of the Linux TPM 1.2 "pcrs"
+# sysfs file, or lines of "<alg> <pcr> <hex digest>".
+
+import sys, struct, hashlib, re, optparse, binascii
+
+EV_NO_ACTION = 0x03
+NUM_PCRS = 24
+# PCRs reset to all ones instead of all zeros on a TPM 2
+DYNAMIC_PCRS = range(17, 23)
+
+TPM2_ALGS = {
+    0x0004: ('sha1', 20),
+    0x000b: ('sha256', 32),
+    0x000c: ('sha384', 48),
+    0x000d: ('sha512', 64),
+    0x0012: ('sm3_256', 32),
+}
+ALG_NAMES = dict((name, algid) for algid, (name, size) in TPM2_ALGS.items())
+
+SPECID_SIGNATURE = b"Spec ID Event03\0"
+
+class LogError(Exception):
+    pass
+
+def new_hash(name):
+    if name == 'sm3_256':
+        name = 'sm3'
+    try:
+        return hashlib.new(name)
+    except ValueError:
+        return None
+
+
+######################################################################
+# Log parsing
+######################################################################
+
+S_U16 = struct.Struct("<H")
+S_U32 = struct.Struct("<I")
+S_HDR = struct.Struct("<II")
+S_PCPES = struct.Struct("<II20sI")
+
+# Parse the algorithm list of a "Spec ID Event03" event
+def parse_specid(event):
+    if len(event) < 24 or event[:16] != SPECID_SIGNATURE:
+        return None
+    count = S_U32.unpack_from(event, 24)[0]
+    sizes = {}
+    pos = 28
+    for i in range(count):
+        if pos + 4 > len(event):
+            raise LogError("truncated Spec ID event")
+        algid, size = struct.unpack_from("<HH", event, pos)
+        sizes[algid] = size
+        pos += 4
+    return sizes
+
+# Yield (pcrindex, eventtype, [(algid, digest), ...], event) for all
+# entries of the log in 'data'
+def parse_log(data):
+    data = memoryview(data)
+    end = len(data)
+    if end < S_PCPES.size:
+        return
+    # The first entry always has the TPM 1.2 layout
+    pcrindex, eventtype, digest, evsize = S_PCPES.unpack_from(data, 0)
+    pos = S_PCPES.size
+    event = data[pos:pos + evsize].tobytes()
+    pos += evsize
+    sizes = None
+    if eventtype == EV_NO_ACTION and pcrindex == 0:
+        sizes = parse_specid(event)
+    yield pcrindex, eventtype, [(0x0004, digest)], event
+    if sizes is None:
+        # TPM 1.2 log
+        while pos + S_PCPES.size <= end:
+            pcrindex, eventtype, digest, evsize = S_PCPES.unpack_from(data,
+                                                                      pos)
+            if not eventtype and not evsize and not any(bytearray(digest)):
+                # Start of the unused (zeroed) part of the log area
+                return
+            pos += S_PCPES.size
+            if pos + evsize > end:
+                raise LogError("truncated event at offset %d" % (pos,))
+            yield (pcrindex, eventtype, [(0x0004, digest)],
+                   data[pos:pos + evsize].tobytes())
+            pos += evsize
+        return
+    # Crypto agile log
+    while pos + S_HDR.size + 4 <= end:
+        start = pos
+        pcrindex, eventtype = S_HDR.unpack_from(data, pos)
+        count = S_U32.unpack_from(data, pos + 8)[0]
+        if not eventtype and not count:
+            return
+        pos += S_HDR.size + 4
+        digests = []
+        for i in range(count):
+            algid = S_U16.unpack_from(data, pos)[0]
+            size = sizes.get(algid)
+            if size is None:
+                raise LogError("unknown algorithm 0x%04x at offset %d"
+                               % (algid, start))
+            pos += 2
+            digests.append((algid, data[pos:pos + size].tobytes()))
+            pos += size
+        if pos + 4 > end:
+            raise LogError("truncated event at offset %d" % (start,))
+        evsize = S_U32.unpack_from(data, pos)[0]
+        pos += 4
+        if pos + evsize > end:
+            raise LogError("truncated event at offset %d" % (start,))
+        yield pcrindex, eventtype, digests, data[pos:pos + evsize].tobytes()
+        pos += evsize
+
+
+######################################################################
+# PCR replay
+######################################################################
+
+# Return ({algid: [pcr values]}, set of extended pcrs, entry count)
+# resulting from the log in 'data'
+def replay(data):
+    banks = {}
+    extended = set()
+    agile = False
+    count = 0
+    for pcrindex, eventtype, digests, event in parse_log(data):
+        count += 1
+        if eventtype == EV_NO_ACTION:
+            if count == 1 and parse_specid(event) is not None:
+                agile = True
+            continue
+        if pcrindex >= NUM_PCRS:
+            raise LogError("invalid pcr index %d in entry %d"
+                           % (pcrindex, count))
+        extended.add(pcrindex)
+        for algid, digest in digests:
+            bank = banks.get(algid)
+            if bank is None:
+                name, size = TPM2_ALGS.get(algid, (None, len(digest)))
+                bank = banks[algid] = [b"\0" * size] * NUM_PCRS
+                if agile:
+                    for idx in DYNAMIC_PCRS:
+                        bank[idx] = b"\xff" * size
+            h = new_hash(TPM2_ALGS.get(algid, ('?', 0))[0])
+            if h is None:
+                continue
+            h.update(bank[pcrindex])
+            h.update(digest)
+            bank[pcrindex] = h.digest()
+    return banks, extended, count
+
+
+######################################################################
+# PCR dumps
+######################################################################
+
+RE_PCRREAD_BANK = re.compile(r'^\s*(\w+)\s*:\s*$')
+RE_PCRREAD_PCR = re.compile(r'^\s*(\d+)\s*:\s*(?:0x)?([0-9a-fA-F]+)\s*$')
+RE_SYSFS_PCR = re.compile(r'^PCR-(\d+):\s*([0-9a-fA-F ]+)$')
+RE_SIMPLE_PCR = re.compile(r'^\s*(\w+)\s+(\d+)\s+(?:0x)?([0-9a-fA-F]+)\s*$')
+
+# Return {algid: {pcrindex: value}} from a PCR dump
+def parse_pcrs(text):
+    pcrs = {}
+    bank = None
+    for line in text.splitlines():
+        m = RE_SYSFS_PCR.match(line)
+        if m:
+            value = m.group(2).replace(' ', '')
+            pcrs.setdefault(0x0004, {})[int(m.group(1))] = value
+            continue
+        m = RE_SIMPLE_PCR.match(line)
+        if m and m.group(1).lower() in ALG_NAMES:
+            algid = ALG_NAMES[m.group(1).lower()]
+            pcrs.setdefault(algid, {})[int(m.group(2))] = m.group(3)
+            continue
+        m = RE_PCRREAD_BANK.match(line)
+        if m:
+            bank = ALG_NAMES.get(m.group(1).lower())
+            continue
+        m = RE_PCRREAD_PCR.match(line)
+        if m and bank is not None:
+            pcrs.setdefault(bank, {})[int(m.group(1))] = m.group(2)
+    for bank in pcrs.values():
+        for idx in bank:
+            bank[idx] = binascii.unhexlify(bank[idx].lower())
+    return pcrs
+
+# Return a list of mismatch descriptions between replayed and read PCRs;
+# only the PCRs in 'extended' are checked unless it is None
+def compare(banks, pcrs, extended):
+    errors = []
+    for algid, values in sorted(pcrs.items()):
+        name = TPM2_ALGS[algid][0]
+        bank = banks.get(algid)
+        if bank is None:
+            errors.append("%s: bank not in log" % (name,))
+            continue
+        for idx, value in sorted(values.items()):
+            if idx >= NUM_PCRS or (extended is not None
+                                   and idx not in extended):
+                continue
+            if bank[idx] != value:
+                errors.append("%s PCR %d: log %s != read %s" % (
+                    name, idx, hexstr(bank[idx]), hexstr(value)))
+    return errors
+
+
+######################################################################
+# Main
+######################################################################
+
+def hexstr(data):
+    return binascii.hexlify(data).decode()
+
+def process(args):
+    logname, pcrname, verbose, allpcrs = args
+    try:
+        f = open(logname, 'rb')
+        data = f.read()
+        f.close()
+        banks, extended, count = replay(data)
+        if pcrname is None:
+            out = ["%s: %d entries" % (logname, count)]
+            for algid, bank in sorted(banks.items()):
+                name = TPM2_ALGS.get(algid, ('alg_%04x' % (algid,), 0))[0]
+                for idx, value in enumerate(bank):
+                    if verbose or idx in extended:
+                        out.append("  %s %d %s" % (name, idx, hexstr(value)))
+            return True, "\n".join(out)
+        f = open(pcrname, 'r')
+        pcrs = parse_pcrs(f.read())
+        f.close()
+        if not pcrs:
+            return False, "%s: no PCR values in %s" % (logname, pcrname)
+        errors = compare(banks, pcrs, None if allpcrs else extended)
+        if errors:
+            return False, "%s: MISMATCH\n  %s" % (logname, "\n  ".join(errors))
+        return True, "%s: OK (%d entries)" % (logname, count)
+    except (IOError, LogError, struct.error) as e:
+        return False, "%s: ERROR %s" % (logname, e)
+
+def main():
+    usage = "%prog [options] <log> [<log> ...]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-p", "--pcrs", dest="pcrs",
+                    help="PCR dump to verify a single log against")
+    opts.add_option("-e", "--pcrs-ext", dest="pcrsext",
+                    help="verify each log against <log><ext>")
+    opts.add_option("-j", "--jobs", dest="jobs", type="int", default=1,
+                    help="number of logs to process in parallel")
+    opts.add_option("-a", "--all-pcrs", action="store_true", dest="allpcrs",
+                    help="verify all PCRs in the dump, not only those"
+                    " extended by the log")
+    opts.add_option("-v", action="store_true", dest="verbose",
+                    help="also show PCRs that were not extended")
+    options, args = opts.parse_args()
+    if not args or (options.pcrs and len(args) != 1):
+        opts.error("Incorrect arguments")
+
+    work = []
+    for logname in args:
+        pcrname = options.pcrs
+        if options.pcrsext:
+            pcrname = logname + options.pcrsext
+        work.append((logname, pcrname, options.verbose, options.allpcrs))
+
+    if options.jobs > 1 and len(work) > 1:
+        import multiprocessing
+        pool = multiprocessing.Pool(options.jobs)
+        results = pool.imap(process, work, chunksize=16)
+    else:
+        results = map(process, work)
+
+    failed = 0
+    for ok, msg in results:
+        sys.stdout.write(msg + "\n")
+        if not ok:
+            failed += 1
+    if failed:
+        sys.stderr.write("%d of %d logs failed\n" % (failed, len(work)))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,237 @@
+// Firmware services used by the TPM code in the tpmsim host program
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "config.h" // CONFIG_TCGBIOS
+#include "fw/paravirt.h" // PlatformRunningOn
+#include "hw/pic.h" // pic_irqmask_mask
+#include "malloc.h" // _malloc
+#include "output.h" // dprintf
+#include "romfile.h" // romfile_loadint
+#include "stacks.h" // yield
+#include "std/acpi.h" // struct tpm2_descriptor_rev2
+#include "string.h" // memset
+#include "tcgbios.h" // tpm_add_acpi_table
+#include "util.h" // find_acpi_table
+#include "x86.h" // cpuid
+#include "tpmsim.h" // host_alloc
+
+#if !CONFIG_TCGBIOS
+#error "tpmsim needs a build with CONFIG_TCGBIOS enabled"
+#endif
+
+int PlatformRunningOn;
+struct smbios_entry_point *SMBiosAddr;
+
+
+/****************************************************************
+ * Memory and strings
+ ****************************************************************/
+
+struct zone_s {
+    int unused;
+};
+struct zone_s ZoneLow, ZoneHigh, ZoneFSeg, ZoneTmpLow, ZoneTmpHigh;
+
+void *
+_malloc(struct zone_s *zone, u32 size, u32 align)
+{
+    return host_alloc(size, align);
+}
+
+void
+free(void *data)
+{
+    host_free(data);
+}
+
+void *
+memset(void *s, int c, size_t n)
+{
+    u8 *p = s;
+    while (n--)
+        *p++ = c;
+    return s;
+}
+
+int
+memcmp(const void *s1, const void *s2, size_t n)
+{
+    const u8 *p1 = s1, *p2 = s2;
+    for (; n; n--, p1++, p2++)
+        if (*p1 != *p2)
+            return *p1 < *p2 ? -1 : 1;
+    return 0;
+}
+
+size_t
+strlen(const char *s)
+{
+    const char *p = s;
+    while (*p)
+        p++;
+    return p - s;
+}
+
+u8
+checksum(void *buf, u32 len)
+{
+    u8 *p = buf, sum = 0;
+    while (len--)
+        sum += *p++;
+    return sum;
+}
+
+
+/****************************************************************
+ * Platform
+ ****************************************************************/
+
+void
+cpuid(u32 index, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    __cpuid(index, eax, ebx, ecx, edx);
+}
+
+// Control registers as the firmware would find them with an OS that
+// switches the fpu state lazily
+static u32 SimCr0 = CR0_PE | CR0_MP | CR0_TS, SimCr4;
+
+u32
+cr0_read(void)
+{
+    return SimCr0;
+}
+
+void
+cr0_write(u32 cr0)
+{
+    SimCr0 = cr0;
+}
+
+u32
+cr4_read(void)
+{
+    return SimCr4;
+}
+
+void
+cr4_write(u32 cr4)
+{
+    SimCr4 = cr4;
+}
+
+int
+in_post(void)
+{
+    return 1;
+}
+
+void
+msleep(u32 count)
+{
+    u32 end = timer_calc_usec(count * 1000);
+    while (!timer_check(end))
+        yield();
+}
+
+void
+pic_irqmask_mask(u16 off, u16 on)
+{
+}
+
+int
+get_keystroke(int msec)
+{
+    return -1;
+}
+
+void
+reset(void)
+{
+    sim_panic("the firmware requested a reset\n");
+}
+
+void
+__warn_noalloc(int lineno, const char *fname)
+{
+    sim_panic("unable to allocate memory at %s:%d\n", fname, lineno);
+}
+
+void
+__warn_timeout(int lineno, const char *fname)
+{
+    SimStats.timeouts++;
+    if (SimConfig.verbose)
+        printf("timeout at %s:%d (%u us)\n", fname, lineno, timer_read());
+}
+
+struct romfile_s *
+romfile_find(const char *name)
+{
+    return NULL;
+}
+
+u64
+romfile_loadint(const char *name, u64 defval)
+{
+    if (!strcmp(name, "etc/tpm-irq"))
+        return SimConfig.irq;
+    if (!strcmp(name, "etc/tpm2-deferred-selftest"))
+        return SimConfig.deferred_selftest;
+    return defval;
+}
+
+int
+qemu_cfg_write_file(void *src, struct romfile_s *file, u32 offset, u32 len)
+{
+    return -1;
+}
+
+
+/****************************************************************
+ * ACPI
+ ****************************************************************/
+
+// A TPM2 table announcing the log area, as QEMU provides it
+#define SIM_LOG_SIZE (64 * 1024)
+
+static u8 SimLog[SIM_LOG_SIZE];
+static struct tpm2_descriptor_rev2 SimTpm2;
+
+void *
+find_acpi_table(u32 signature)
+{
+    if (signature != TPM2_SIGNATURE)
+        return NULL;
+    SimTpm2.signature = TPM2_SIGNATURE;
+    SimTpm2.length = sizeof(SimTpm2);
+    SimTpm2.revision = 4;
+    SimTpm2.log_area_minimum_length = sizeof(SimLog);
+    if (SimConfig.log_size && SimConfig.log_size < sizeof(SimLog))
+        SimTpm2.log_area_minimum_length = SimConfig.log_size;
+    SimTpm2.log_area_start_address = (unsigned long)SimLog;
+    SimTpm2.checksum -= checksum(&SimTpm2, sizeof(SimTpm2));
+    return &SimTpm2;
+}
+
+void *
+sim_log_area(u32 *size)
+{
+    *size = SimTpm2.log_area_minimum_length;
+    return (void*)(unsigned long)SimTpm2.log_area_start_address;
+}
+
+// Hand a table to tcgbios for measuring as the ACPI code would
+void
+sim_add_acpi_table(void)
+{
+    static struct {
+        struct acpi_table_header hdr;
+        u8 data[200];
+    } PACKED table;
+    table.hdr.signature = DSDT_SIGNATURE;
+    table.hdr.length = sizeof(table);
+    memset(table.data, 0xa5, sizeof(table.data));
+    tpm_add_acpi_table(&table.hdr);
+}
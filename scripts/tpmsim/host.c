@@ -0,0 +1,224 @@
+// Host side services for the firmware code in the tpmsim program
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include <stdarg.h> // va_list
+#include <stdio.h> // vprintf
+#include <stdlib.h> // exit
+#include <sys/mman.h> // mmap
+#include <ucontext.h> // swapcontext
+
+#include "tpmsim.h" // host_alloc
+
+
+/****************************************************************
+ * Memory
+ ****************************************************************/
+
+// The firmware stores pointers in 32bit fields, so everything it gets
+// comes from an area below 4GiB.
+#define ARENA_SIZE (64 << 20)
+
+struct block {
+    struct block *next;
+    unsigned int size;
+};
+
+static char *ArenaNext, *ArenaEnd;
+static struct block *FreeBlocks;
+
+void *
+host_alloc(unsigned int size, unsigned int align)
+{
+    if (!ArenaNext) {
+        ArenaNext = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE
+                         , MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (ArenaNext == MAP_FAILED)
+            sim_panic("can't map the memory arena\n");
+        ArenaEnd = ArenaNext + ARENA_SIZE;
+    }
+    size = (size + 15) & ~15;
+    if (align < 16)
+        align = 16;
+
+    // reuse a freed block of the same size
+    struct block **pprev = &FreeBlocks, *b;
+    for (; (b = *pprev); pprev = &b->next) {
+        if (b->size == size && !((unsigned long)(b + 1) & (align - 1))) {
+            *pprev = b->next;
+            return b + 1;
+        }
+    }
+
+    unsigned long data = (unsigned long)ArenaNext + sizeof(*b);
+    data = (data + align - 1) & ~(unsigned long)(align - 1);
+    if (data + size > (unsigned long)ArenaEnd)
+        return NULL;
+    b = (struct block *)data - 1;
+    b->size = size;
+    ArenaNext = (char *)data + size;
+    return b + 1;
+}
+
+void
+host_free(void *data)
+{
+    if (!data)
+        return;
+    struct block *b = (struct block *)data - 1;
+    b->next = FreeBlocks;
+    FreeBlocks = b;
+}
+
+
+/****************************************************************
+ * Threads
+ ****************************************************************/
+
+// Cooperative threads like the ones of src/stacks.c: a new thread runs
+// right away and every yield() switches to the next thread in the list.
+#define THREAD_STACK_SIZE (64 * 1024)
+
+struct thread_info {
+    struct thread_info *next;
+    ucontext_t ctx;
+    void (*func)(void *);
+    void *data;
+    void *stack;
+};
+
+static struct thread_info MainThread = { .next = &MainThread };
+static struct thread_info *CurThread = &MainThread, *DeadThread;
+
+static void
+thread_reap(void)
+{
+    if (!DeadThread)
+        return;
+    host_free(DeadThread->stack);
+    free(DeadThread);
+    DeadThread = NULL;
+}
+
+static void
+thread_switch(struct thread_info *next)
+{
+    struct thread_info *cur = CurThread;
+    CurThread = next;
+    swapcontext(&cur->ctx, &next->ctx);
+    thread_reap();
+}
+
+static void
+thread_start(void)
+{
+    thread_reap();
+    struct thread_info *cur = CurThread, *prev = cur;
+    cur->func(cur->data);
+
+    // leave the list and continue with the next thread for good
+    while (prev->next != cur)
+        prev = prev->next;
+    prev->next = cur->next;
+    DeadThread = cur;
+    CurThread = cur->next;
+    setcontext(&CurThread->ctx);
+}
+
+void
+run_thread(void (*func)(void *), void *data)
+{
+    struct thread_info *thread = calloc(1, sizeof(*thread));
+    if (thread)
+        thread->stack = host_alloc(THREAD_STACK_SIZE, 16);
+    if (!thread || !thread->stack) {
+        free(thread);
+        func(data);
+        return;
+    }
+    thread->func = func;
+    thread->data = data;
+    getcontext(&thread->ctx);
+    thread->ctx.uc_stack.ss_sp = thread->stack;
+    thread->ctx.uc_stack.ss_size = THREAD_STACK_SIZE;
+    thread->ctx.uc_link = NULL;
+    makecontext(&thread->ctx, thread_start, 0);
+
+    thread->next = CurThread->next;
+    CurThread->next = thread;
+    thread_switch(thread);
+}
+
+// Waiting for a thread also lets the simulated time pass
+void
+yield(void)
+{
+    sim_advance(SimConfig.yield_ns);
+    if (CurThread->next != CurThread)
+        thread_switch(CurThread->next);
+}
+
+// The 18.2 Hz timer wakes up a firmware sleeping in yield_toirq()
+#define SIM_TICK_NS 54925439ULL
+
+void
+yield_toirq(void)
+{
+    if (CurThread->next != CurThread || !SimConfig.irq) {
+        yield();
+        return;
+    }
+    unsigned long long tick = (sim_now() / SIM_TICK_NS + 1) * SIM_TICK_NS;
+    while (sim_now() < tick && !sim_irq_pending())
+        sim_advance(SimConfig.yield_ns);
+}
+
+void
+wait_threads(void)
+{
+    while (MainThread.next != &MainThread)
+        yield();
+}
+
+struct mutex_s {
+    unsigned int isLocked;
+};
+
+void
+mutex_lock(struct mutex_s *mutex)
+{
+    while (mutex->isLocked)
+        yield();
+    mutex->isLocked = 1;
+}
+
+void
+mutex_unlock(struct mutex_s *mutex)
+{
+    mutex->isLocked = 0;
+}
+
+
+/****************************************************************
+ * Output
+ ****************************************************************/
+
+void
+__dprintf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+void
+sim_panic(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "tpmsim: ");
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(2);
+}
@@ -0,0 +1,50 @@
+// Forced include for building firmware code into the tpmsim host program
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+#ifndef __HOSTSHIM_H
+#define __HOSTSHIM_H
+
+// The firmware declares these with a 32bit size_t; keep them apart
+// from the C library functions of the same name.
+#define memset sim_memset
+#define memcmp sim_memcmp
+#define strlen sim_strlen
+#define free sim_free
+
+// MMIO accesses go to the simulated TPM instead of the memory bus, and
+// the control registers are simulated as well.
+#define readb x86_readb
+#define readw x86_readw
+#define readl x86_readl
+#define readq x86_readq
+#define writeb x86_writeb
+#define writew x86_writew
+#define writel x86_writel
+#define cr0_read x86_cr0_read
+#define cr0_write x86_cr0_write
+#define cr4_read x86_cr4_read
+#define cr4_write x86_cr4_write
+#include "x86.h"
+#undef readb
+#undef readw
+#undef readl
+#undef readq
+#undef writeb
+#undef writew
+#undef writel
+#undef cr0_read
+#undef cr0_write
+#undef cr4_read
+#undef cr4_write
+
+u8 readb(const void *addr);
+u32 readl(const void *addr);
+u64 readq(const void *addr);
+void writeb(void *addr, u8 val);
+void writel(void *addr, u32 val);
+u32 cr0_read(void);
+void cr0_write(u32 cr0);
+u32 cr4_read(void);
+void cr4_write(u32 cr4);
+
+#endif // hostshim.h
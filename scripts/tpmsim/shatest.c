@@ -0,0 +1,134 @@
+// Comparison of the SHA extension block functions with the C code
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+// src/sha_ni.c is built unmodified; its control register accesses go to
+// registers simulated in glue.c. The accelerated block functions must
+// produce the same state as the plain C ones for random data, random
+// chaining values and every message length, and sha_ni_end() must
+// restore the control registers the firmware was called with.
+
+#include "output.h" // printf
+#include "sha.h" // sha1_blocks_ni
+#include "std/tcg.h" // SHA256_BUFSIZE
+#include "string.h" // memcmp
+#include "x86.h" // cr0_read
+#include "tpmsim.h" // sim_sha_test
+
+#define SHA_TEST_MAXLEN 1024
+
+static u32 ShaTestSeed = 0x2545f491;
+
+static u32
+sha_test_random(void)
+{
+    ShaTestSeed ^= ShaTestSeed << 13;
+    ShaTestSeed ^= ShaTestSeed >> 17;
+    ShaTestSeed ^= ShaTestSeed << 5;
+    return ShaTestSeed;
+}
+
+static void
+sha_test_fill(void *buf, u32 len)
+{
+    u8 *p = buf;
+    while (len--)
+        *p++ = sha_test_random();
+}
+
+// Run the block functions of both implementations on the same input
+static int
+sha_test_blocks(const u8 *data, u32 len)
+{
+    struct sha1_ctx sha1_c, sha1_ni;
+    struct sha256_ctx sha256_c, sha256_ni;
+    sha_test_fill(&sha1_c, sizeof(sha1_c));
+    sha_test_fill(&sha256_c, sizeof(sha256_c));
+    sha1_ni = sha1_c;
+    sha256_ni = sha256_c;
+
+    // without sha_ni_begin() the C code is used
+    sha1_blocks(&sha1_c, data, len);
+    sha256_blocks(&sha256_c, data, len);
+
+    u32 cr0 = cr0_read(), cr4 = cr4_read();
+    struct sha_ni_state st;
+    if (sha_ni_begin(&st)) {
+        printf("  sha_ni_begin() failed\n");
+        return -1;
+    }
+    int ret = 0;
+    if (cr0_read() & (CR0_EM | CR0_TS) || !(cr4_read() & CR4_OSFXSR)) {
+        printf("  sha_ni_begin() didn't enable SSE\n");
+        ret = -1;
+    }
+    if (sha1_blocks_ni(&sha1_ni, data, len)
+        || sha256_blocks_ni(&sha256_ni, data, len)) {
+        printf("  the accelerated block functions refused to run\n");
+        ret = -1;
+    }
+    sha_ni_end(&st);
+    if (cr0_read() != cr0 || cr4_read() != cr4) {
+        printf("  sha_ni_end() didn't restore cr0/cr4\n");
+        ret = -1;
+    }
+
+    if (memcmp(&sha1_c, &sha1_ni, sizeof(sha1_c))) {
+        printf("  sha1 blocks differ for %d bytes\n", len);
+        ret = -1;
+    }
+    if (memcmp(&sha256_c, &sha256_ni, sizeof(sha256_c))) {
+        printf("  sha256 blocks differ for %d bytes\n", len);
+        ret = -1;
+    }
+    return ret;
+}
+
+// Compare complete digests, which also covers the padding of sha*_final()
+static int
+sha_test_digests(const u8 *data, u32 len)
+{
+    u8 hash_c[SHA256_BUFSIZE], hash_ni[SHA256_BUFSIZE];
+    struct sha1_ctx sha1_ctx;
+    struct sha256_ctx sha256_ctx;
+    int ret = 0;
+
+    sha1_init(&sha1_ctx);
+    sha1_final(&sha1_ctx, data, len, len, hash_c);
+    sha1(data, len, hash_ni);
+    if (memcmp(hash_c, hash_ni, SHA1_BUFSIZE)) {
+        printf("  sha1 digests differ for %d bytes\n", len);
+        ret = -1;
+    }
+
+    sha256_init(&sha256_ctx);
+    sha256_final(&sha256_ctx, data, len, len, hash_c);
+    sha256(data, len, hash_ni);
+    if (memcmp(hash_c, hash_ni, SHA256_BUFSIZE)) {
+        printf("  sha256 digests differ for %d bytes\n", len);
+        ret = -1;
+    }
+    return ret;
+}
+
+// Returns 1 if the cpu doesn't have the SHA extensions
+int
+sim_sha_test(int rounds)
+{
+    static u8 data[SHA_TEST_MAXLEN];
+    struct sha_ni_state st;
+
+    sha_setup();
+    if (sha_ni_begin(&st))
+        return 1;
+    sha_ni_end(&st);
+
+    int ret = 0, i;
+    for (i = 0; i < rounds && !ret; i++) {
+        u32 len = i <= SHA_TEST_MAXLEN ? i : sha_test_random() % SHA_TEST_MAXLEN;
+        sha_test_fill(data, len);
+        if (sha_test_blocks(data, len & ~63) || sha_test_digests(data, len))
+            ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,796 @@
+// Simulated TPM 2 behind a TIS or CRB register file
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+// The MMIO accesses of src/hw/tpm_drivers.c end up here (see
+// hostshim.h). Every access and every yield() advances a simulated
+// clock, and the TPM signals commandReady, accepts FIFO bursts and
+// completes commands according to the latencies in SimConfig, so the
+// timeout handling of the drivers runs in simulated time. The TPM
+// itself understands the commands tcgbios.c sends and keeps sha1 and
+// sha256 PCR banks, so that the event log can be checked against them.
+
+#include "byteorder.h" // be32_to_cpu
+#include "hw/tpm_drivers.h" // TIS_REG_STS
+#include "output.h" // printf
+#include "sha.h" // sha256
+#include "std/tcg.h" // TPM2_CC_PCR_Extend
+#include "string.h" // memcpy
+#include "util.h" // timer_calc_usec
+#include "tpmsim.h" // SimConfig
+
+struct sim_config SimConfig;
+struct sim_stats SimStats;
+
+// Simulated time in nanoseconds
+static u64 SimClock;
+
+#define SIM_BUFSIZE 4096
+#define SIM_PCRS 24
+
+#define TIS_INTF_ID     (1 << 13)       // PTP FIFO, FIFO selectable
+#define TIS_INTF_CAP    (3 << 28)       // interface version 1.3 for TPM 2
+#define TIS_DID_VID     0x00011014
+#define CRB_INTF_ID     (1 | (1 << 14)) // CRB active, CRB selectable
+#define CRB_LOC_STATE_VALID     (1 << 7)
+#define CRB_REQ_CMD_READY       (1 << 0)
+#define CRB_REQ_GO_IDLE         (1 << 1)
+#define CRB_STS_ERROR           (1 << 0)
+#define CRB_STS_IDLE            (1 << 1)
+#define CRB_INT_START           (1 << 0)
+#define CRB_INT_CMD_READY       (1 << 1)
+#define CRB_INT_GLOBAL_ENABLE   (1 << 31)
+
+#define TPM2_RC_BAD_TAG         0x01e
+#define TPM2_RC_HASH            0x083
+#define TPM2_RC_VALUE           0x084
+#define TPM2_RC_SIZE            0x095
+#define TPM2_RC_FAILURE         0x101
+#define TPM2_RC_COMMAND_SIZE    0x142
+#define TPM2_RC_COMMAND_CODE    0x143
+
+enum { ST_IDLE, ST_READY, ST_RECEPTION, ST_EXECUTION, ST_COMPLETION };
+
+static struct {
+    int state;
+    int locality;               // active locality, -1 if none
+    u8 requests;                // localities waiting for access
+    u64 ready_at;               // time commandReady gets signalled
+    int ready_irq;              // the TIS commandReady irq is due
+    u64 done_at;                // time the executing command completes
+    u64 fifo_at;                // time the TIS FIFO takes the next burst
+    u32 burst_left;             // bytes left in the current FIFO burst
+    u8 cmd[SIM_BUFSIZE];
+    u32 cmdlen;
+    u8 rsp[SIM_BUFSIZE];
+    u32 rsplen, rspoff;
+    u32 int_enable, int_status;
+    u8 int_vector;
+    u32 crb_req, crb_start, crb_error;
+    // TPM state
+    int started;
+    u32 extend_calls;
+    u64 selftest_done;
+    u32 random;
+    u8 pcr_sha1[SIM_PCRS][SHA1_BUFSIZE];
+    u8 pcr_sha256[SIM_PCRS][SHA256_BUFSIZE];
+} Sim;
+
+// The command and response buffer of the CRB interface; as with QEMU
+// both share the same memory.
+u8 SimCrbBuffer[0x1000 - CRB_REG_DATA_BUFFER] __aligned(8);
+
+// PCRs 17 to 22 are reset to all ones
+static void
+sim_reset_pcrs(u8 sha1[][SHA1_BUFSIZE], u8 sha256[][SHA256_BUFSIZE])
+{
+    memset(sha1, 0, SIM_PCRS * SHA1_BUFSIZE);
+    memset(sha256, 0, SIM_PCRS * SHA256_BUFSIZE);
+    int i;
+    for (i = 17; i <= 22; i++) {
+        memset(sha1[i], 0xff, SHA1_BUFSIZE);
+        memset(sha256[i], 0xff, SHA256_BUFSIZE);
+    }
+}
+
+void
+sim_reset(void)
+{
+    memset(&Sim, 0, sizeof(Sim));
+    memset(&SimStats, 0, sizeof(SimStats));
+    memset(SimCrbBuffer, 0, sizeof(SimCrbBuffer));
+    SimClock = 0;
+    Sim.locality = SimConfig.locality;
+    Sim.random = 0x12345678;
+    sim_reset_pcrs(Sim.pcr_sha1, Sim.pcr_sha256);
+    SimStats.last_locality = -1;
+}
+
+u64
+sim_now(void)
+{
+    return SimClock;
+}
+
+// A driver that waits longer than this for a TPM doesn't time out
+#define SIM_TIME_LIMIT (600ULL * 1000000000ULL)
+
+void
+sim_advance(u64 ns)
+{
+    SimClock += ns;
+    if (SimClock > SIM_TIME_LIMIT)
+        sim_panic("the firmware waited for %llu s of simulated time\n"
+                  , SIM_TIME_LIMIT / 1000000000ULL);
+}
+
+
+/****************************************************************
+ * Timer
+ ****************************************************************/
+
+// One timer tick per microsecond of simulated time
+u32
+timer_read(void)
+{
+    return SimClock / 1000;
+}
+
+u32
+timer_calc_usec(u32 usecs)
+{
+    return timer_read() + usecs;
+}
+
+int
+timer_check(u32 end)
+{
+    return (s32)(timer_read() - end) > 0;
+}
+
+u32
+timer_to_usec(u32 time)
+{
+    return time;
+}
+
+
+/****************************************************************
+ * TPM 2 commands
+ ****************************************************************/
+
+static u16 get_be16(const u8 *p) { return be16_to_cpu(*(u16*)p); }
+static u32 get_be32(const u8 *p) { return be32_to_cpu(*(u32*)p); }
+static void put_be16(u8 *p, u16 v) { *(u16*)p = cpu_to_be16(v); }
+static void put_be32(u8 *p, u32 v) { *(u32*)p = cpu_to_be32(v); }
+
+static void
+sim_extend_bank(u8 *pcr, const u8 *digest, u32 size)
+{
+    u8 buf[2 * SHA256_BUFSIZE];
+    memcpy(buf, pcr, size);
+    memcpy(buf + size, digest, size);
+    if (size == SHA1_BUFSIZE)
+        sha1(buf, 2 * size, pcr);
+    else
+        sha256(buf, 2 * size, pcr);
+}
+
+static u32
+sim_pcr_extend(const u8 *cmd, u32 len)
+{
+    if (get_be16(cmd) != TPM2_ST_SESSIONS)
+        return TPM2_RC_BAD_TAG;
+    if (++Sim.extend_calls == SimConfig.fail_extend)
+        return TPM2_RC_FAILURE;
+    u32 pcr = get_be32(cmd + 10);
+    const u8 *p = cmd + 18 + get_be32(cmd + 14), *end = cmd + len;
+    if (pcr >= SIM_PCRS)
+        return TPM2_RC_VALUE;
+    if (p + 4 > end)
+        return TPM2_RC_SIZE;
+    u32 count = get_be32(p), i;
+    for (p += 4, i = 0; i < count; i++) {
+        if (p + 2 > end)
+            return TPM2_RC_SIZE;
+        u16 hashalg = get_be16(p);
+        u32 size;
+        switch (hashalg) {
+        case TPM2_ALG_SHA1:   size = SHA1_BUFSIZE; break;
+        case TPM2_ALG_SHA256: size = SHA256_BUFSIZE; break;
+        default:
+            return TPM2_RC_HASH;
+        }
+        if (p + 2 + size > end)
+            return TPM2_RC_SIZE;
+        if (hashalg == TPM2_ALG_SHA1)
+            sim_extend_bank(Sim.pcr_sha1[pcr], p + 2, size);
+        else
+            sim_extend_bank(Sim.pcr_sha256[pcr], p + 2, size);
+        p += 2 + size;
+    }
+    if (p != end)
+        return TPM2_RC_SIZE;
+    SimStats.extends++;
+    return 0;
+}
+
+// Execute the command in Sim.cmd and put the response into Sim.rsp
+static void
+sim_execute(void)
+{
+    const u8 *cmd = Sim.cmd;
+    u8 *rsp = Sim.rsp, *p = rsp + sizeof(struct tpm_rsp_header);
+    u32 len = Sim.cmdlen, rc = 0, i;
+    u32 ordinal = len >= 10 ? get_be32(cmd + 6) : 0;
+    int sessions = 0;
+
+    SimStats.commands++;
+    SimStats.last_locality = Sim.locality;
+
+    if (len < 10 || get_be32(cmd + 2) != len) {
+        rc = TPM2_RC_COMMAND_SIZE;
+    } else if (!Sim.started && ordinal != TPM2_CC_Startup) {
+        rc = TPM2_RC_INITIALIZE;
+    } else {
+        switch (ordinal) {
+        case TPM2_CC_Startup:
+            Sim.started = 1;
+            break;
+        case TPM2_CC_SelfTest:
+            if (cmd[10] == TPM2_NO)
+                Sim.selftest_done = SimClock + SimConfig.selftest_us * 1000ULL;
+            break;
+        case TPM2_CC_GetTestResult:
+            put_be16(p, 0);
+            put_be32(p + 2, SimClock < Sim.selftest_done ? TPM2_RC_TESTING : 0);
+            p += 6;
+            break;
+        case TPM2_CC_GetCapability:
+            if (get_be32(cmd + 10) != TPM2_CAP_PCRS) {
+                rc = TPM2_RC_VALUE;
+                break;
+            }
+            *p++ = 0;
+            put_be32(p, TPM2_CAP_PCRS);
+            put_be32(p + 4, 2);
+            p += 8;
+            put_be16(p, TPM2_ALG_SHA1);
+            put_be16(p + 6, TPM2_ALG_SHA256);
+            p[2] = p[8] = 3;
+            memset(p + 3, 0xff, 3);
+            memset(p + 9, 0xff, 3);
+            p += 12;
+            break;
+        case TPM2_CC_GetRandom: {
+            u16 count = get_be16(cmd + 10);
+            if (count > SHA256_BUFSIZE)
+                count = SHA256_BUFSIZE;
+            put_be16(p, count);
+            for (p += 2, i = 0; i < count; i++) {
+                Sim.random = Sim.random * 1103515245 + 12345;
+                *p++ = Sim.random >> 16;
+            }
+            break;
+        }
+        case TPM2_CC_PCR_Extend:
+            rc = sim_pcr_extend(cmd, len);
+            sessions = 1;
+            break;
+        case TPM2_CC_HierarchyControl:
+        case TPM2_CC_HierarchyChangeAuth:
+            sessions = 1;
+            break;
+        case TPM2_CC_StirRandom:
+            break;
+        default:
+            rc = TPM2_RC_COMMAND_CODE;
+        }
+    }
+
+    if (rc) {
+        p = rsp + sizeof(struct tpm_rsp_header);
+        sessions = 0;
+    } else if (sessions) {
+        // empty parameter area and a password session without a nonce
+        put_be32(p, 0);
+        put_be16(p + 4, 0);
+        p[6] = TPM2_YES;
+        put_be16(p + 7, 0);
+        p += 9;
+    }
+    put_be16(rsp, sessions ? TPM2_ST_SESSIONS : TPM2_ST_NO_SESSIONS);
+    put_be32(rsp + 2, p - rsp);
+    put_be32(rsp + 6, rc);
+    Sim.rsplen = p - rsp;
+    Sim.rspoff = 0;
+}
+
+
+/****************************************************************
+ * Register file
+ ****************************************************************/
+
+static void
+sim_raise_irq(u32 events)
+{
+    if (Sim.int_enable & TIS_INT_GLOBAL_ENABLE && !SimConfig.lost_irq)
+        Sim.int_status |= events & Sim.int_enable;
+}
+
+// Let the time based state changes happen
+static void
+sim_update(void)
+{
+    if (Sim.state == ST_EXECUTION && !SimConfig.hang
+        && SimClock >= Sim.done_at) {
+        sim_execute();
+        Sim.state = ST_COMPLETION;
+        if (SimConfig.iface == SIM_CRB) {
+            memcpy(SimCrbBuffer, Sim.rsp, Sim.rsplen);
+            Sim.crb_start = 0;
+            sim_raise_irq(CRB_INT_START);
+        } else {
+            sim_raise_irq(TIS_INT_DATA_AVAILABLE | TIS_INT_STS_VALID);
+        }
+    }
+    if (Sim.crb_req & CRB_REQ_CMD_READY && SimClock >= Sim.ready_at) {
+        Sim.crb_req &= ~CRB_REQ_CMD_READY;
+        Sim.state = ST_READY;
+        sim_raise_irq(CRB_INT_CMD_READY);
+    }
+    if (Sim.ready_irq && SimClock >= Sim.ready_at) {
+        Sim.ready_irq = 0;
+        if (Sim.state == ST_READY)
+            sim_raise_irq(TIS_INT_COMMAND_READY);
+    }
+}
+
+// The TPM asserts its irq line
+int
+sim_irq_pending(void)
+{
+    sim_update();
+    return Sim.int_status != 0;
+}
+
+static void
+sim_command_ready(void)
+{
+    // a command in progress is aborted
+    Sim.state = ST_READY;
+    Sim.ready_at = SimClock + SimConfig.ready_us * 1000ULL;
+    Sim.ready_irq = SimConfig.iface == SIM_TIS;
+    Sim.cmdlen = Sim.rsplen = Sim.rspoff = 0;
+    Sim.burst_left = 0;
+    Sim.fifo_at = 0;
+}
+
+static void
+sim_start(void)
+{
+    Sim.state = ST_EXECUTION;
+    Sim.done_at = SimClock + SimConfig.cmd_us * 1000ULL;
+}
+
+// The number of bytes the TIS FIFO accepts or provides right now
+static u32
+tis_burst(void)
+{
+    if (SimClock < Sim.fifo_at)
+        return 0;
+    if (!Sim.burst_left)
+        Sim.burst_left = SimConfig.burst;
+    if (Sim.state == ST_COMPLETION && Sim.burst_left > Sim.rsplen - Sim.rspoff)
+        return Sim.rsplen - Sim.rspoff;
+    return Sim.burst_left;
+}
+
+static void
+tis_fifo_used(u32 len)
+{
+    if (len > tis_burst()) {
+        SimStats.overruns++;
+        Sim.burst_left = len;
+    }
+    SimStats.fifo_bytes += len;
+    Sim.burst_left -= len;
+    if (!Sim.burst_left)
+        Sim.fifo_at = SimClock + SimConfig.burst_us * 1000ULL;
+}
+
+// The TPM expects more bytes of the command being received
+static int
+tis_expect(void)
+{
+    return Sim.cmdlen < 6 || Sim.cmdlen < get_be32(Sim.cmd + 2);
+}
+
+static u32
+tis_sts(void)
+{
+    u32 sts = TIS_STS_VALID;
+    switch (Sim.state) {
+    case ST_READY:
+        if (SimClock < Sim.ready_at)
+            return sts;
+        sts |= TIS_STS_COMMAND_READY;
+        break;
+    case ST_RECEPTION:
+        if (tis_expect())
+            sts |= TIS_STS_EXPECT;
+        break;
+    case ST_COMPLETION:
+        if (Sim.rspoff >= Sim.rsplen)
+            return sts;
+        sts |= TIS_STS_DATA_AVAILABLE;
+        break;
+    default:
+        return sts;
+    }
+    return sts | (tis_burst() << 8);
+}
+
+static u32
+tis_access(int locty)
+{
+    u32 access = TIS_ACCESS_TPM_REG_VALID_STS;
+    if (Sim.locality == locty) {
+        access |= TIS_ACCESS_ACTIVE_LOCALITY;
+        if (Sim.requests)
+            access |= TIS_ACCESS_PENDING_REQUEST;
+    }
+    if (Sim.requests & (1 << locty))
+        access |= TIS_ACCESS_REQUEST_USE;
+    return access;
+}
+
+static void
+tis_access_write(int locty, u8 val)
+{
+    if (val & TIS_ACCESS_ACTIVE_LOCALITY) {
+        // relinquish the locality or withdraw the request for it
+        Sim.requests &= ~(1 << locty);
+        if (Sim.locality == locty) {
+            Sim.locality = -1;
+            Sim.state = ST_IDLE;
+        }
+    }
+    if (val & TIS_ACCESS_REQUEST_USE && Sim.locality != locty)
+        Sim.requests |= 1 << locty;
+    if (Sim.locality < 0 && Sim.requests) {
+        int l = 4;
+        while (!(Sim.requests & (1 << l)))
+            l--;
+        Sim.requests &= ~(1 << l);
+        Sim.locality = l;
+        Sim.state = ST_IDLE;
+        sim_raise_irq(TIS_INT_LOCALITY_CHANGE);
+    }
+}
+
+static u32
+tis_fifo_read(int size)
+{
+    if (Sim.state != ST_COMPLETION || Sim.rspoff + size > Sim.rsplen) {
+        SimStats.errors++;
+        return ~0;
+    }
+    tis_fifo_used(size);
+    u32 val = 0;
+    int i;
+    for (i = 0; i < size; i++)
+        val |= Sim.rsp[Sim.rspoff++] << (i * 8);
+    return val;
+}
+
+static void
+tis_fifo_write(u32 val, int size)
+{
+    if (Sim.state == ST_READY && SimClock >= Sim.ready_at) {
+        Sim.state = ST_RECEPTION;
+        Sim.cmdlen = 0;
+    }
+    if (Sim.state != ST_RECEPTION || !tis_expect()
+        || Sim.cmdlen + size > SIM_BUFSIZE) {
+        SimStats.errors++;
+        return;
+    }
+    tis_fifo_used(size);
+    int i;
+    for (i = 0; i < size; i++)
+        Sim.cmd[Sim.cmdlen++] = val >> (i * 8);
+    if (Sim.cmdlen >= 6 && Sim.cmdlen > get_be32(Sim.cmd + 2))
+        SimStats.errors++;
+}
+
+// The status and the FIFO only work for the active locality
+static int
+tis_locality_reg(u32 reg)
+{
+    return (reg >= TIS_REG_STS && reg < TIS_REG_STS + 4)
+        || (reg >= TIS_REG_DATA_FIFO && reg < TIS_REG_DATA_FIFO + 4);
+}
+
+static u32
+tis_read(int locty, u32 reg, int size)
+{
+    if (reg == TIS_REG_ACCESS)
+        return tis_access(locty);
+    if (tis_locality_reg(reg) && locty != Sim.locality) {
+        SimStats.stray++;
+        return ~0;
+    }
+    if (reg >= TIS_REG_DATA_FIFO && reg < TIS_REG_DATA_FIFO + 4) {
+        if (size > 1 && SimConfig.narrow_fifo) {
+            SimStats.errors++;
+            return ~0;
+        }
+        return tis_fifo_read(size);
+    }
+    u32 val;
+    switch (reg & ~3) {
+    case TIS_REG_INT_ENABLE:      val = Sim.int_enable; break;
+    case TIS_REG_INT_VECTOR:      val = Sim.int_vector; break;
+    case TIS_REG_INT_STATUS:      val = Sim.int_status; break;
+    case TIS_REG_STS:             val = tis_sts(); break;
+    case TIS_REG_IFACE_ID:        val = TIS_INTF_ID; break;
+    case TIS_REG_DID_VID:         val = TIS_DID_VID; break;
+    case TIS_REG_INTF_CAPABILITY:
+        val = TIS_INTF_CAP;
+        if (!SimConfig.narrow_fifo)
+            val |= TIS_CAP_DATA_TRANSFER_SIZE;
+        break;
+    default:                      val = 0;
+    }
+    return val >> ((reg & 3) * 8);
+}
+
+static void
+tis_write(int locty, u32 reg, u32 val, int size)
+{
+    if (reg == TIS_REG_ACCESS) {
+        tis_access_write(locty, val);
+        return;
+    }
+    if (tis_locality_reg(reg) && locty != Sim.locality) {
+        SimStats.stray++;
+        return;
+    }
+    if (reg >= TIS_REG_DATA_FIFO && reg < TIS_REG_DATA_FIFO + 4) {
+        if (size > 1 && SimConfig.narrow_fifo)
+            SimStats.errors++;
+        else
+            tis_fifo_write(val, size);
+        return;
+    }
+    u32 mask = size == 4 ? ~0 : 0xff;
+    switch (reg) {
+    case TIS_REG_INT_ENABLE:
+        Sim.int_enable = (Sim.int_enable & ~mask) | val;
+        break;
+    case TIS_REG_INT_VECTOR:
+        Sim.int_vector = val;
+        break;
+    case TIS_REG_INT_STATUS:
+        Sim.int_status &= ~val;
+        break;
+    case TIS_REG_IFACE_ID:
+        // interface selection and lock; the FIFO interface stays active
+        break;
+    case TIS_REG_STS:
+        if (val & TIS_STS_COMMAND_READY)
+            sim_command_ready();
+        if (val & TIS_STS_TPM_GO) {
+            if (Sim.state == ST_RECEPTION && !tis_expect())
+                sim_start();
+            else
+                SimStats.errors++;
+        }
+        if (val & TIS_STS_RESPONSE_RETRY)
+            Sim.rspoff = 0;
+        break;
+    default:
+        SimStats.errors++;
+    }
+}
+
+static u32
+crb_read(int locty, u32 reg)
+{
+    if (locty) {
+        SimStats.stray++;
+        return ~0;
+    }
+    switch (reg) {
+    case CRB_REG_LOC_STATE:      return CRB_LOC_STATE_VALID;
+    case CRB_REG_INTF_ID:        return CRB_INTF_ID;
+    case CRB_REG_CTRL_REQ:       return Sim.crb_req;
+    case CRB_REG_CTRL_STS:
+        return Sim.crb_error | (Sim.state == ST_IDLE ? CRB_STS_IDLE : 0);
+    case CRB_REG_CTRL_START:     return Sim.crb_start;
+    case CRB_REG_INT_ENABLE:     return Sim.int_enable;
+    case CRB_REG_INT_STS:        return Sim.int_status;
+    case CRB_REG_CTRL_CMD_SIZE:
+    case CRB_REG_CTRL_RSP_SIZE:  return sizeof(SimCrbBuffer);
+    case CRB_REG_CTRL_CMD_LADDR:
+    case CRB_REG_CTRL_RSP_ADDR:  return (unsigned long)SimCrbBuffer;
+    }
+    return 0;
+}
+
+static void
+crb_write(int locty, u32 reg, u32 val)
+{
+    if (locty) {
+        SimStats.stray++;
+        return;
+    }
+    switch (reg) {
+    case CRB_REG_INTF_ID:
+        break;
+    case CRB_REG_CTRL_REQ:
+        if (val & CRB_REQ_CMD_READY) {
+            sim_command_ready();
+            Sim.crb_req |= CRB_REQ_CMD_READY;
+            Sim.state = ST_IDLE;
+        }
+        if (val & CRB_REQ_GO_IDLE)
+            Sim.state = ST_IDLE;
+        break;
+    case CRB_REG_CTRL_START:
+        if (!(val & 1))
+            break;
+        if (Sim.state == ST_EXECUTION) {
+            SimStats.errors++;
+            break;
+        }
+        Sim.cmdlen = get_be32(SimCrbBuffer + 2);
+        if (Sim.cmdlen > sizeof(SimCrbBuffer)) {
+            Sim.crb_error = CRB_STS_ERROR;
+            SimStats.errors++;
+            break;
+        }
+        memcpy(Sim.cmd, SimCrbBuffer, Sim.cmdlen);
+        Sim.crb_start = 1;
+        sim_start();
+        break;
+    case CRB_REG_INT_ENABLE:
+        Sim.int_enable = val;
+        break;
+    case CRB_REG_INT_STS:
+        Sim.int_status &= ~val;
+        break;
+    default:
+        SimStats.errors++;
+    }
+}
+
+// Every MMIO access takes some time and lets the TPM make progress
+static u32
+sim_access(const void *addr, int *locty)
+{
+    unsigned long a = (unsigned long)addr;
+    if (a < TPM_TIS_BASE_ADDRESS || a >= TPM_TIS_BASE_ADDRESS + (5 << 12))
+        sim_panic("MMIO access outside of the TPM at %p\n", addr);
+    sim_advance(SimConfig.access_ns);
+    SimStats.accesses++;
+    sim_update();
+    *locty = (a - TPM_TIS_BASE_ADDRESS) >> 12;
+    return a & 0xfff;
+}
+
+static u32
+sim_read(const void *addr, int size)
+{
+    int locty;
+    u32 reg = sim_access(addr, &locty);
+    if (SimConfig.iface == SIM_CRB)
+        return crb_read(locty, reg);
+    return tis_read(locty, reg, size);
+}
+
+static void
+sim_write(void *addr, u32 val, int size)
+{
+    int locty;
+    u32 reg = sim_access(addr, &locty);
+    if (SimConfig.iface == SIM_CRB)
+        crb_write(locty, reg, val);
+    else
+        tis_write(locty, reg, val, size);
+}
+
+u8
+readb(const void *addr)
+{
+    return sim_read(addr, 1);
+}
+
+u32
+readl(const void *addr)
+{
+    return sim_read(addr, 4);
+}
+
+u64
+readq(const void *addr)
+{
+    u64 val = sim_read(addr, 4);
+    return val | ((u64)sim_read(addr + 4, 4) << 32);
+}
+
+void
+writeb(void *addr, u8 val)
+{
+    sim_write(addr, val, 1);
+}
+
+void
+writel(void *addr, u32 val)
+{
+    sim_write(addr, val, 4);
+}
+
+
+/****************************************************************
+ * Event log
+ ****************************************************************/
+
+/*
+ * Replay the crypto agile event log and compare the result with the
+ * PCRs of the TPM. Returns the number of measurements in the log or -1
+ * if a PCR doesn't match.
+ */
+int
+sim_log_verify(void)
+{
+    static u8 pcr_sha1[SIM_PCRS][SHA1_BUFSIZE];
+    static u8 pcr_sha256[SIM_PCRS][SHA256_BUFSIZE];
+    u32 size, pos, count = 0;
+    u8 *log = sim_log_area(&size);
+    if (!log)
+        return -1;
+
+    sim_reset_pcrs(pcr_sha1, pcr_sha256);
+    // the first event is in the sha1 format and holds the spec id
+    pos = 8 + SHA1_BUFSIZE;
+    pos += 4 + le32_to_cpu(*(u32*)(log + pos));
+    while (pos + 12 <= size) {
+        u32 pcr = le32_to_cpu(*(u32*)(log + pos));
+        u32 digests = le32_to_cpu(*(u32*)(log + pos + 8)), i;
+        if (!digests)
+            break;
+        if (pcr >= SIM_PCRS)
+            sim_panic("log entry %d is for PCR %d\n", count, pcr);
+        for (pos += 12, i = 0; i < digests; i++) {
+            u16 hashalg = le16_to_cpu(*(u16*)(log + pos));
+            pos += 2;
+            switch (hashalg) {
+            case TPM2_ALG_SHA1:
+                sim_extend_bank(pcr_sha1[pcr], log + pos, SHA1_BUFSIZE);
+                pos += SHA1_BUFSIZE;
+                break;
+            case TPM2_ALG_SHA256:
+                sim_extend_bank(pcr_sha256[pcr], log + pos, SHA256_BUFSIZE);
+                pos += SHA256_BUFSIZE;
+                break;
+            default:
+                sim_panic("log entry %d has hash algorithm %04x\n"
+                          , count, hashalg);
+            }
+        }
+        pos += 4 + le32_to_cpu(*(u32*)(log + pos));
+        count++;
+    }
+
+    int pcr, ret = count;
+    for (pcr = 0; pcr < SIM_PCRS; pcr++) {
+        if (memcmp(pcr_sha1[pcr], Sim.pcr_sha1[pcr], SHA1_BUFSIZE)
+            || memcmp(pcr_sha256[pcr], Sim.pcr_sha256[pcr], SHA256_BUFSIZE)) {
+            printf("PCR %d does not match the event log\n", pcr);
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,399 @@
+// Regression tests and benchmark of the TPM drivers on a simulated TPM
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+// src/hw/tpm_drivers.c and src/tcgbios.c are built into this program
+// unmodified. Their MMIO accesses go to the register file of a
+// simulated TPM (sim.c) that runs in simulated time, so a boot with a
+// TPM that takes seconds to time out is checked in milliseconds.
+//
+// Usage:
+//   tpmsim [options]            run all tests
+//   tpmsim [options] -t NAME    run one test
+//   tpmsim [options] -p         time one boot and print its statistics
+//
+// The options change the simulated TPM the tests start from:
+//   -i tis|crb   interface (default tis)
+//   -a NS        duration of an MMIO access (default 1000)
+//   -y NS        time passing per yield (default 1000)
+//   -r US        commandReady latency (default 50)
+//   -c US        command execution time (default 200)
+//   -b N         burstCount of the TIS FIFO (default 64)
+//   -B US        time the TIS FIFO needs after each burst (default 0)
+//   -s US        run the self test in the background for US
+//   -n           TIS FIFO only supports byte accesses
+//   -H           the TPM never completes a command
+//   -F N         the N-th PCR_Extend fails
+//   -l N         locality that is active at reset (default none)
+//   -q IRQ       irq of the TPM
+//   -Q           the TPM never raises its irq
+//   -m N         number of option roms measured per boot (default 8)
+//   -v           print the timeouts the firmware reports
+
+#include <stdio.h> // printf
+#include <stdlib.h> // strtoul
+#include <string.h> // strcmp
+#include <sys/wait.h> // waitpid
+#include <time.h> // clock_gettime
+#include <unistd.h> // fork
+
+#include "tpmsim.h" // SimConfig
+
+// Firmware interfaces (the firmware headers don't mix with the C library)
+void tpm_setup(void);
+void tpm_prepboot(void);
+void tpm_option_rom(const void *addr, unsigned int len);
+int tpmhw_transmit(unsigned char locty, void *req, void *respbuffer
+                   , unsigned int *respbufferlen, int to_t);
+extern unsigned char TPM_working;
+
+#define TPM2_CC_GetRandom 0x17b
+
+static int Measurements = 8;
+
+// Boot with the TPM: the POST measurements, some option roms and the
+// measurements before booting the OS
+static void
+boot(void)
+{
+    static unsigned char rom[32 * 1024];
+    int i;
+
+    sim_reset();
+    sim_add_acpi_table();
+    tpm_setup();
+    for (i = 0; i < Measurements; i++) {
+        memset(rom, i, sizeof(rom));
+        tpm_option_rom(rom, sizeof(rom));
+    }
+    tpm_prepboot();
+}
+
+#define check(cond) do {                                        \
+        if (!(cond)) {                                          \
+            printf("  check failed: %s (line %d)\n", #cond, __LINE__); \
+            ret = -1;                                           \
+        }                                                       \
+    } while (0)
+
+// The drivers kept to the interface protocol and the log is right
+static int
+check_boot(void)
+{
+    int ret = 0;
+    check(TPM_working);
+    check(SimStats.stray == 0);
+    check(SimStats.overruns == 0);
+    check(SimStats.errors == 0);
+    check(SimStats.timeouts == 0);
+    int count = sim_log_verify();
+    check(count >= 0);
+    check(count == SimStats.extends);
+    // POST, option roms, "Calling INT 19h" and 8 separators
+    check(SimStats.extends >= Measurements + 10);
+    return ret;
+}
+
+static int
+test_boot(void)
+{
+    boot();
+    return check_boot();
+}
+
+static int
+test_narrow(void)
+{
+    SimConfig.narrow_fifo = 1;
+    return test_boot();
+}
+
+static int
+test_burst(void)
+{
+    // bursts smaller than the response header and a slow FIFO
+    SimConfig.burst = 3;
+    SimConfig.burst_us = 20;
+    return test_boot();
+}
+
+static int
+test_irq(void)
+{
+    SimConfig.irq = 11;
+    return test_boot();
+}
+
+// A TPM that doesn't raise the irq it was given may only make the first
+// wait sleep until the next timer tick (about 55ms), not every one
+static int
+test_lost_irq(void)
+{
+    SimConfig.irq = 11;
+    SimConfig.lost_irq = 1;
+    int ret = test_boot();
+    check(sim_now() < 200ULL * 1000000ULL);
+    return ret;
+}
+
+static int
+test_selftest(void)
+{
+    SimConfig.deferred_selftest = 1;
+    SimConfig.selftest_us = 30000;
+    return test_boot();
+}
+
+static int
+test_locality(void)
+{
+    int ret;
+    SimConfig.locality = 2;
+    boot();
+    ret = check_boot();
+    check(SimStats.last_locality == 0);
+
+    // a command at another locality and back at locality 0
+    struct {
+        unsigned char tag[2], size[4], ordinal[4], count[2];
+    } __attribute__((packed)) req = {
+        { 0x80, 0x01 }, { 0, 0, 0, 12 },
+        { 0, 0, TPM2_CC_GetRandom >> 8, TPM2_CC_GetRandom & 0xff }, { 0, 8 }
+    };
+    unsigned char rsp[64];
+    unsigned int len = sizeof(rsp);
+    check(tpmhw_transmit(3, &req, rsp, &len, 0) == 0);
+    check(len == 20);
+    check(SimStats.last_locality == 3);
+    len = sizeof(rsp);
+    check(tpmhw_transmit(0, &req, rsp, &len, 0) == 0);
+    check(SimStats.last_locality == 0);
+    check(SimStats.stray == 0);
+    return ret;
+}
+
+// A log area that fills up is moved to a larger one
+static int
+test_log_grow(void)
+{
+    SimConfig.log_size = 512;
+    boot();
+    int ret = check_boot();
+    unsigned int size;
+    sim_log_area(&size);
+    check(size > SimConfig.log_size);
+    return ret;
+}
+
+// The log must only hold the events that were extended
+static int
+test_fail_extend(void)
+{
+    int ret = 0;
+    SimConfig.fail_extend = 6;
+    boot();
+    check(!TPM_working);
+    check(SimStats.stray == 0);
+    check(SimStats.errors == 0);
+    int count = sim_log_verify();
+    check(count == SimStats.extends);
+    check(SimStats.extends == SimConfig.fail_extend - 1);
+    return ret;
+}
+
+// A TPM that doesn't respond must not hang the boot
+static int
+test_hang(void)
+{
+    int ret = 0;
+    SimConfig.hang = 1;
+    SimConfig.yield_ns = 100000;
+    boot();
+    check(!TPM_working);
+    check(SimStats.timeouts > 0);
+    check(SimStats.commands == 0);
+    check(SimStats.extends == 0);
+    // A few commands time out before the TPM is given up; the CRB driver
+    // waits with the long TPM 1.2 default durations
+    check(sim_now() < 120ULL * 1000000000ULL);
+    return ret;
+}
+
+// The SHA extension code computes the same hashes as the C code
+static int
+test_sha_ni(void)
+{
+    int ret = sim_sha_test(4096);
+    if (ret > 0)
+        printf("     %-14s skipped, the cpu has no SHA extensions\n", "");
+    return ret < 0 ? -1 : 0;
+}
+
+struct test {
+    const char *name;
+    int iface;
+    int (*run)(void);
+};
+
+static const struct test Tests[] = {
+    { "sha-ni", SIM_TIS, test_sha_ni },
+    { "tis", SIM_TIS, test_boot },
+    { "tis-narrow", SIM_TIS, test_narrow },
+    { "tis-burst", SIM_TIS, test_burst },
+    { "tis-irq", SIM_TIS, test_irq },
+    { "tis-lost-irq", SIM_TIS, test_lost_irq },
+    { "tis-selftest", SIM_TIS, test_selftest },
+    { "tis-locality", SIM_TIS, test_locality },
+    { "tis-log-grow", SIM_TIS, test_log_grow },
+    { "tis-fail", SIM_TIS, test_fail_extend },
+    { "tis-hang", SIM_TIS, test_hang },
+    { "crb", SIM_CRB, test_boot },
+    { "crb-irq", SIM_CRB, test_irq },
+    { "crb-lost-irq", SIM_CRB, test_lost_irq },
+    { "crb-selftest", SIM_CRB, test_selftest },
+    { "crb-fail", SIM_CRB, test_fail_extend },
+    { "crb-hang", SIM_CRB, test_hang },
+};
+
+static double
+wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Every test runs in its own process, as the firmware state can't be reset
+static int
+run_test(const struct test *t, int iface_set)
+{
+    if (iface_set && t->iface != SimConfig.iface)
+        return 0;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (!pid) {
+        SimConfig.iface = t->iface;
+        int ret = t->run();
+        printf("%-4s %-14s %9.1f ms simulated, %4u commands\n"
+               , ret ? "FAIL" : "ok", t->name, sim_now() / 1000000.0
+               , SimStats.commands);
+        fflush(stdout);
+        _exit(ret ? 1 : 0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) > 1)
+        printf("FAIL %-14s crashed\n", t->name);
+    return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+static void
+benchmark(void)
+{
+    double start = wall_ms();
+    boot();
+    double wall = wall_ms() - start;
+    unsigned int cmds = SimStats.commands ? SimStats.commands : 1;
+    printf("interface       %s, burst %u, access %u ns, command %u us\n"
+           , SimConfig.iface == SIM_CRB ? "crb" : "tis", SimConfig.burst
+           , SimConfig.access_ns, SimConfig.cmd_us);
+    printf("tpm working     %s\n", TPM_working ? "yes" : "no");
+    printf("commands        %u (%u extends)\n"
+           , SimStats.commands, SimStats.extends);
+    printf("simulated time  %.3f ms (%.1f us per command)\n"
+           , sim_now() / 1000000.0, sim_now() / 1000.0 / cmds);
+    printf("mmio accesses   %llu (%.1f per command)\n"
+           , SimStats.accesses, (double)SimStats.accesses / cmds);
+    printf("fifo bytes      %llu\n", SimStats.fifo_bytes);
+    printf("timeouts        %u\n", SimStats.timeouts);
+    printf("protocol errors %u stray, %u overruns, %u other\n"
+           , SimStats.stray, SimStats.overruns, SimStats.errors);
+    printf("wall time       %.3f ms\n", wall);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-i tis|crb] [-a ns] [-y ns] [-r us] [-c us]"
+            " [-b n] [-B us] [-s us] [-n] [-H] [-F n] [-l n] [-q irq] [-Q]"
+            " [-m n] [-v] [-t name | -p]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *name = NULL;
+    int opt, perf = 0, iface_set = 0;
+
+    SimConfig.iface = SIM_TIS;
+    SimConfig.access_ns = 1000;
+    SimConfig.yield_ns = 1000;
+    SimConfig.ready_us = 50;
+    SimConfig.cmd_us = 200;
+    SimConfig.burst = 64;
+    SimConfig.locality = -1;
+
+    while ((opt = getopt(argc, argv, "i:a:y:r:c:b:B:s:nHF:l:q:Qm:vt:p")) != -1) {
+        switch (opt) {
+        case 'i':
+            if (!strcmp(optarg, "tis"))
+                SimConfig.iface = SIM_TIS;
+            else if (!strcmp(optarg, "crb"))
+                SimConfig.iface = SIM_CRB;
+            else
+                usage(argv[0]);
+            iface_set = 1;
+            break;
+        case 'a': SimConfig.access_ns = strtoul(optarg, NULL, 0); break;
+        case 'y': SimConfig.yield_ns = strtoul(optarg, NULL, 0); break;
+        case 'r': SimConfig.ready_us = strtoul(optarg, NULL, 0); break;
+        case 'c': SimConfig.cmd_us = strtoul(optarg, NULL, 0); break;
+        case 'b': SimConfig.burst = strtoul(optarg, NULL, 0); break;
+        case 'B': SimConfig.burst_us = strtoul(optarg, NULL, 0); break;
+        case 's':
+            SimConfig.selftest_us = strtoul(optarg, NULL, 0);
+            SimConfig.deferred_selftest = 1;
+            break;
+        case 'n': SimConfig.narrow_fifo = 1; break;
+        case 'H': SimConfig.hang = 1; break;
+        case 'F': SimConfig.fail_extend = strtoul(optarg, NULL, 0); break;
+        case 'l': SimConfig.locality = strtol(optarg, NULL, 0); break;
+        case 'q': SimConfig.irq = strtoul(optarg, NULL, 0); break;
+        case 'Q': SimConfig.lost_irq = 1; break;
+        case 'm': Measurements = strtoul(optarg, NULL, 0); break;
+        case 'v': SimConfig.verbose = 1; break;
+        case 't': name = optarg; break;
+        case 'p': perf = 1; break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || !SimConfig.burst || SimConfig.locality > 4)
+        usage(argv[0]);
+
+    if (perf) {
+        benchmark();
+        return 0;
+    }
+
+    int i, failed = 0, found = 0;
+    double start = wall_ms();
+    for (i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++) {
+        if (name && strcmp(name, Tests[i].name))
+            continue;
+        found = 1;
+        if (run_test(&Tests[i], iface_set && !name))
+            failed++;
+    }
+    if (!found) {
+        fprintf(stderr, "no test %s\n", name);
+        return 2;
+    }
+    printf("%d test(s) failed, %.1f ms\n", failed, wall_ms() - start);
+    return failed ? 1 : 0;
+}
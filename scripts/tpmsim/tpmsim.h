@@ -0,0 +1,70 @@
+// Interface between the simulated TPM, the firmware glue and the host side
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+#ifndef __TPMSIM_H
+#define __TPMSIM_H
+
+// This header is used next to both the firmware and the C library
+// headers, which disagree on the fixed size types; only use C types.
+
+#define SIM_TIS 0
+#define SIM_CRB 1
+
+// Behaviour of the simulated TPM; all times are simulated time
+struct sim_config {
+    int iface;                  // SIM_TIS or SIM_CRB
+    unsigned int access_ns;     // duration of one MMIO register access
+    unsigned int yield_ns;      // time passing each time a thread yields
+    unsigned int ready_us;      // delay until commandReady is signalled
+    unsigned int cmd_us;        // time the TPM needs to execute a command
+    unsigned int burst;         // burstCount of the TIS data FIFO
+    unsigned int burst_us;      // time the TIS FIFO needs after each burst
+    unsigned int selftest_us;   // duration of a background self test
+    int narrow_fifo;            // TIS FIFO only supports byte accesses
+    int hang;                   // commands never complete
+    unsigned int fail_extend;   // the n-th TPM2_PCR_Extend fails
+    int locality;               // locality active at reset, -1 for none
+    unsigned int log_size;      // size of the log area in the TPM2 table
+    int irq;                    // value of etc/tpm-irq
+    int lost_irq;               // the TPM never raises its irq
+    int deferred_selftest;      // value of etc/tpm2-deferred-selftest
+    int verbose;                // print the warnings of the firmware
+};
+
+// Observations of the simulated TPM
+struct sim_stats {
+    unsigned long long accesses;   // MMIO register accesses
+    unsigned long long fifo_bytes; // bytes moved through the TIS FIFO
+    unsigned int commands;      // commands executed
+    unsigned int extends;       // successful TPM2_PCR_Extend commands
+    unsigned int stray;         // accesses to a locality that isn't active
+    unsigned int overruns;      // FIFO accesses beyond the burstCount
+    unsigned int errors;        // accesses violating the interface protocol
+    unsigned int timeouts;      // warn_timeout() calls of the firmware
+    int last_locality;          // locality of the last command
+};
+
+extern struct sim_config SimConfig;
+extern struct sim_stats SimStats;
+
+// sim.c
+void sim_reset(void);
+unsigned long long sim_now(void);
+void sim_advance(unsigned long long ns);
+int sim_irq_pending(void);
+int sim_log_verify(void);
+
+// glue.c
+void *sim_log_area(unsigned int *size);
+void sim_add_acpi_table(void);
+
+// shatest.c
+int sim_sha_test(int rounds);
+
+// host.c
+void *host_alloc(unsigned int size, unsigned int align);
+void host_free(void *data);
+void sim_panic(const char *fmt, ...)
+    __attribute__ ((format (printf, 1, 2))) __attribute__ ((noreturn));
+
+#endif // tpmsim.h
@@ -104,5 +104,6 @@
 #define DEBUG_invalid 3
 #define DEBUG_thread 2
 #define DEBUG_tcg 20
+#define DEBUG_tcg_stats 3
 
 #endif // config.h
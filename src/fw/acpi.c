@@ -19,6 +19,7 @@
 #include "romfile.h" // romfile_loadint
 #include "std/acpi.h" // struct rsdp_descriptor
 #include "string.h" // memset
+#include "tcgbios.h" // tpm_add_acpi_table
 #include "util.h" // MaxCountCPUs
 #include "x86.h" // readl
 
@@ -674,6 +675,14 @@ acpi_setup(void)
     memcpy(rsdt->table_offset_entry, tables, sizeof(u32) * tbl_idx);
     build_header((void*)rsdt, RSDT_SIGNATURE, rsdt_len, 1);
 
+    // Measure the final tables
+    int i;
+    for (i = 0; i < tbl_idx; i++)
+        tpm_add_acpi_table((void*)le32_to_cpu(tables[i]));
+    if (fadt && fadt->dsdt)
+        tpm_add_acpi_table((void*)le32_to_cpu(fadt->dsdt));
+    tpm_add_acpi_table((void*)rsdt);
+
     // Build rsdp pointer table
     struct rsdp_descriptor rsdp;
     memset(&rsdp, 0, sizeof(rsdp));
@@ -22,6 +22,7 @@
 #include "romfile.h" // romfile_loadint
 #include "romfile_loader.h" // romfile_loader_execute
 #include "string.h" // memset
+#include "tcgbios.h" // tpm_hash_update
 #include "util.h" // pci_setup
 #include "x86.h" // cpuid
 #include "xen.h" // xen_biostable_setup
@@ -215,6 +216,14 @@ qemu_platform_setup(void)
 #define QEMU_CFG_NUMA                   0x0d
 #define QEMU_CFG_BOOT_MENU              0x0e
 #define QEMU_CFG_NB_CPUS                0x05
+#define QEMU_CFG_KERNEL_SIZE            0x08
+#define QEMU_CFG_INITRD_SIZE            0x0b
+#define QEMU_CFG_KERNEL_DATA            0x11
+#define QEMU_CFG_INITRD_DATA            0x12
+#define QEMU_CFG_CMDLINE_SIZE           0x14
+#define QEMU_CFG_CMDLINE_DATA           0x15
+#define QEMU_CFG_SETUP_SIZE             0x17
+#define QEMU_CFG_SETUP_DATA             0x18
 #define QEMU_CFG_MAX_CPUS               0x0f
 #define QEMU_CFG_FILE_DIR               0x19
 #define QEMU_CFG_ARCH_LOCAL             0x8000
@@ -338,6 +347,123 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
     return file->size;
 }
 
+// Read a file in chunks and add each chunk to the 'hctx' measurement
+// as soon as it has landed, while it is still in the cache
+static int
+qemu_cfg_read_file_hashed(struct romfile_s *file, void *dst, u32 maxlen
+                          , struct tpm_hash_ctx *hctx)
+{
+    if (file->size > maxlen)
+        return -1;
+    struct qemu_romfile_s *qfile;
+    qfile = container_of(file, struct qemu_romfile_s, file);
+    qemu_cfg_select(qfile->select);
+    qemu_cfg_skip(qfile->skip);
+    u32 pos;
+    for (pos = 0; pos < file->size; pos += TPM_HASH_CHUNK) {
+        u32 len = file->size - pos;
+        if (len > TPM_HASH_CHUNK)
+            len = TPM_HASH_CHUNK;
+        qemu_cfg_read(dst + pos, len);
+        romfile_hash_chunk(hctx, dst + pos, pos, len);
+    }
+    return file->size;
+}
+
+// Add the contents of a fw_cfg entry to the 'hctx' measurement. The
+// data is streamed through 'buf' in chunks that stay in the cache. The
+// entry is selected again (via DMA) for every chunk and other threads
+// get to run in between, since they may access fw_cfg as well.
+static void
+qemu_cfg_hash_entry(u16 key, u32 size, void *buf, struct tpm_hash_ctx *hctx)
+{
+    u32 pos;
+    for (pos = 0; pos < size; pos += TPM_HASH_CHUNK) {
+        u32 len = size - pos;
+        if (len > TPM_HASH_CHUNK)
+            len = TPM_HASH_CHUNK;
+        qemu_cfg_dma_transfer(0, pos, (key << 16) | QEMU_CFG_DMA_CTL_SELECT
+                              | QEMU_CFG_DMA_CTL_SKIP);
+        qemu_cfg_dma_transfer(buf, len, QEMU_CFG_DMA_CTL_READ);
+        tpm_hash_update(hctx, buf, len);
+        yield();
+    }
+}
+
+static void
+qemu_cfg_measure_kernel_thread(void *data)
+{
+    u32 setup_size = 0, initrd_size = 0, cmdline_size = 0;
+    u32 kernel_size = (u32)data;
+    qemu_cfg_read_entry(&setup_size, QEMU_CFG_SETUP_SIZE, sizeof(setup_size));
+    qemu_cfg_read_entry(&initrd_size, QEMU_CFG_INITRD_SIZE
+                        , sizeof(initrd_size));
+    qemu_cfg_read_entry(&cmdline_size, QEMU_CFG_CMDLINE_SIZE
+                        , sizeof(cmdline_size));
+
+    // Keep the hash state off the (small) thread stack
+    struct tpm_hash_ctx *hctx = malloc_tmp(sizeof(*hctx));
+    char *buf = malloc_tmp(TPM_HASH_CHUNK + 1);
+    if (!hctx || !buf) {
+        warn_noalloc();
+        goto done;
+    }
+    if (tpm_measure_start(hctx))
+        goto done;
+    dprintf(3, "Measuring kernel %d+%d initrd %d cmdline %d\n"
+            , setup_size, kernel_size, initrd_size, cmdline_size);
+
+    qemu_cfg_hash_entry(QEMU_CFG_SETUP_DATA, setup_size, buf, hctx);
+    qemu_cfg_hash_entry(QEMU_CFG_KERNEL_DATA, kernel_size, buf, hctx);
+    const char *desc = "Linux kernel";
+    tpm_add_ipl_hashed(4, desc, strlen(desc), hctx);
+
+    if (initrd_size && !tpm_measure_start(hctx)) {
+        qemu_cfg_hash_entry(QEMU_CFG_INITRD_DATA, initrd_size, buf, hctx);
+        desc = "Linux initrd";
+        tpm_add_ipl_hashed(4, desc, strlen(desc), hctx);
+    }
+
+    if (cmdline_size && !tpm_measure_start(hctx)) {
+        // Log the command line itself if it fits in the buffer
+        qemu_cfg_hash_entry(QEMU_CFG_CMDLINE_DATA, cmdline_size, buf, hctx);
+        if (cmdline_size <= TPM_HASH_CHUNK) {
+            buf[cmdline_size] = '\0';
+            desc = buf;
+        } else {
+            desc = "Linux cmdline";
+        }
+        tpm_add_ipl_hashed(5, desc, strlen(desc), hctx);
+    }
+
+done:
+    free(buf);
+    free(hctx);
+}
+
+// Measure the kernel, initrd and command line of a direct kernel boot.
+// The linuxboot/multiboot option rom that loads them reads fw_cfg on
+// its own, so this is a separate pass over the data through fw_cfg. It
+// runs in a thread, in parallel with the hardware init, and only with
+// fw_cfg DMA - byte-wise port i/o would stall the boot for a long time
+// with a large initrd.
+void
+qemu_cfg_measure_kernel(void)
+{
+    if (!CONFIG_TCGBIOS || !qemu_cfg_enabled())
+        return;
+    u32 kernel_size = 0;
+    qemu_cfg_read_entry(&kernel_size, QEMU_CFG_KERNEL_SIZE
+                        , sizeof(kernel_size));
+    if (!kernel_size)
+        return;
+    if (!qemu_cfg_dma_enabled()) {
+        dprintf(1, "fw_cfg DMA not available - not measuring the kernel\n");
+        return;
+    }
+    run_thread(qemu_cfg_measure_kernel_thread, (void*)kernel_size);
+}
+
 // Bare-bones function for writing a file knowing only its unique
 // identifying key (select)
 int
@@ -382,6 +508,7 @@ qemu_romfile_add(char *name, int select, int skip, int size)
     qfile->select = select;
     qfile->skip = skip;
     qfile->file.copy = qemu_cfg_read_file;
+    qfile->file.copy_hashed = qemu_cfg_read_file_hashed;
     romfile_add(&qfile->file);
 }
 
@@ -7,6 +7,8 @@
 #include "list.h" // struct hlist_node
 #include "output.h" // warn_*
 #include "paravirt.h" // qemu_cfg_write_file
+#include "std/acpi.h" // struct acpi_table_header
+#include "tcgbios.h" // tpm_add_acpi_table
 
 struct romfile_loader_file {
     struct romfile_s *file;
@@ -147,6 +149,12 @@ static void romfile_loader_add_checksum(struct romfile_loader_entry_s *entry,
     data = file->data + offset;
     *data -= checksum(file->data + start, len);
 
+    /* The checksum of an ACPI table is set once the table is final */
+    struct acpi_table_header *table = file->data + start;
+    if (offset == start + offsetof(struct acpi_table_header, checksum)
+        && len >= sizeof(*table) && le32_to_cpu(table->length) == len)
+        tpm_add_acpi_table(table);
+
     return;
 err:
     warn_internalerror();
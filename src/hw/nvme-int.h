@@ -103,6 +103,8 @@ struct nvme_ctrl {
     u32 ns_count;
     struct nvme_namespace *ns;
 
+    u8 mdts;                    /* log2 of the max transfer size in pages */
+
     struct nvme_sq io_sq;
     struct nvme_cq io_cq;
 };
@@ -117,8 +119,10 @@ struct nvme_namespace {
 
     u32 block_size;
     u32 metadata_size;
+    u32 max_req_size;           /* in blocks */
 
-    /* Page aligned buffer of size NVME_PAGE_SIZE. */
+    /* Page aligned buffer of size NVME_PAGE_SIZE. Bounce buffer for
+       unaligned requests or PRP list for the others. */
     char *dma_buffer;
 };
 
@@ -130,8 +134,12 @@ struct nvme_identify_ctrl {
     char sn[20];
     char mn[40];
     char fr[8];
+    u8 rab;
+    u8 ieee[3];
+    u8 cmic;
+    u8 mdts;                    /* max data transfer size (log2 pages) */
 
-    char _boring[516 - 72];
+    char _boring[516 - 78];
 
     u32 nn;                     /* number of namespaces */
 };
@@ -189,6 +197,10 @@ union nvme_identify {
 #define NVME_CQE_DW3_P (1U << 16)
 
 #define NVME_PAGE_SIZE 4096
+#define NVME_PAGE_MASK ~(NVME_PAGE_SIZE - 1)
+
+/* Number of PRP entries that fit into the PRP list page. */
+#define NVME_MAX_PRPL_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
 
 /* Length for the queue entries. */
 #define NVME_SQE_SIZE_LOG 6
@@ -150,11 +150,12 @@ nvme_wait(struct nvme_sq *sq)
 }
 
 /* Returns the next submission queue entry (or NULL if the queue is full). It
-   also fills out Command Dword 0 and clears the rest. */
+   also fills out Command Dword 0 and clears the rest. Several entries may be
+   requested before they are handed to the controller with nvme_commit_sqe. */
 static struct nvme_sqe *
 nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full");
         return NULL;
     }
@@ -164,23 +165,24 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
 
     memset(sqe, 0, sizeof(*sqe));
     sqe->cdw0 = opc | (sq->tail << 16 /* CID */);
+    sq->tail = (sq->tail + 1) & sq->common.mask;
     sqe->mptr = (u32)metadata;
     sqe->dptr_prp1 = (u32)data;
 
-    if (sqe->dptr_prp1 & (NVME_PAGE_SIZE - 1)) {
-        /* Data buffer not page aligned. */
+    if (sqe->dptr_prp1 & 0x3) {
+        /* Data buffer not dword aligned. */
         warn_internalerror();
     }
 
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Call this after you've filled out the sqes that you've got from
+   nvme_get_next_sqe. Rings the doorbell once for all of them. */
 static void
 nvme_commit_sqe(struct nvme_sq *sq)
 {
     dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
-    sq->tail = (sq->tail + 1) & sq->common.mask;
     writel(sq->common.dbl, sq->tail);
 }
 
@@ -281,7 +283,19 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
     ns->drive.blksize   = ns->block_size;
     ns->drive.sectors   = ns->lba_count;
 
+    /* A request is limited by the size of our PRP list and the controller's
+       maximum data transfer size (MDTS). */
+    u32 max_req_size = NVME_MAX_PRPL_ENTRIES * NVME_PAGE_SIZE;
+    if (ctrl->mdts && ctrl->mdts < 20
+        && (NVME_PAGE_SIZE << ctrl->mdts) < max_req_size)
+        max_req_size = NVME_PAGE_SIZE << ctrl->mdts;
+    ns->max_req_size = max_req_size / ns->block_size;
+
     ns->dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!ns->dma_buffer) {
+        warn_noalloc();
+        goto free_buffer;
+    }
 
     char *desc = znprintf(MAXDESCSIZE, "NVMe NS %u: %llu MiB (%llu %u-byte "
                           "blocks + %u-byte metadata)\n",
@@ -401,43 +415,87 @@ err:
     return -1;
 }
 
-/* Reads count sectors into buf. Returns DISK_RET_*. The buffer cannot cross
-   page boundaries. */
+/* Reads count sectors into buf. Returns DISK_RET_*. The buffer must be dword
+   aligned and may span at most NVME_MAX_PRPL_ENTRIES pages. The transfer is
+   split into commands of up to ns->max_req_size blocks, which are all
+   submitted with a single doorbell write and completed together. */
 static int
 nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
                   int write)
 {
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
     u32 buf_addr = (u32)buf;
+    u32 size = count * ns->block_size;
 
-    if ((buf_addr & 0x3) ||
-        ((buf_addr & ~(NVME_PAGE_SIZE - 1)) !=
-         ((buf_addr + ns->block_size * count - 1) & ~(NVME_PAGE_SIZE - 1)))) {
-        /* Buffer is misaligned or crosses page boundary */
+    if ((buf_addr & 0x3) || !count
+        || size > NVME_MAX_PRPL_ENTRIES * NVME_PAGE_SIZE) {
+        /* Buffer is misaligned or the request is too large */
         warn_internalerror();
         return DISK_RET_EBADTRACK;
     }
 
-    struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
-                                                 write ? NVME_SQE_OPC_IO_WRITE
-                                                       : NVME_SQE_OPC_IO_READ,
-                                                 NULL, buf);
-    io_read->nsid = ns->ns_id;
-    io_read->dword[10] = (u32)lba;
-    io_read->dword[11] = (u32)(lba >> 32);
-    io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
+    /* Build one PRP list with all pages after the first one. PRP1 of each
+       command may point into the middle of a page, its remaining pages are
+       described by the part of the list that follows that page. */
+    u64 *prpl = (void*)ns->dma_buffer;
+    u32 first_page = buf_addr & NVME_PAGE_MASK;
+    u32 end = buf_addr + size;
+    u32 page;
+    int i = 0;
+    for (page = first_page + NVME_PAGE_SIZE; page < end; page += NVME_PAGE_SIZE)
+        prpl[i++] = page;
+
+    int cmds = 0;
+    u16 done = 0;
+    while (done < count) {
+        u16 blocks = count - done;
+        if (blocks > ns->max_req_size)
+            blocks = ns->max_req_size;
+        u32 start = buf_addr + done * ns->block_size;
+        u32 cmd_end = start + blocks * ns->block_size;
+        u32 next_page = (start & NVME_PAGE_MASK) + NVME_PAGE_SIZE;
+        u32 prp2 = 0;
+        if (cmd_end > next_page + NVME_PAGE_SIZE)
+            prp2 = (u32)&prpl[(next_page - first_page) / NVME_PAGE_SIZE - 1];
+        else if (cmd_end > next_page)
+            prp2 = next_page;
+
+        u8 opc = write ? NVME_SQE_OPC_IO_WRITE : NVME_SQE_OPC_IO_READ;
+        struct nvme_sqe *io_read = nvme_get_next_sqe(sq, opc, NULL,
+                                                     (void*)start);
+        if (!io_read) {
+            warn_internalerror();
+            break;
+        }
+        io_read->dptr_prp2 = prp2;
+        io_read->nsid = ns->ns_id;
+        io_read->dword[10] = (u32)(lba + done);
+        io_read->dword[11] = (u32)((lba + done) >> 32);
+        io_read->dword[12] = (1U << 31 /* limited retry */) | (blocks - 1);
 
-    nvme_commit_sqe(&ns->ctrl->io_sq);
+        cmds++;
+        done += blocks;
+    }
 
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
+    int res = done == count ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    if (!cmds)
+        return res;
 
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+    nvme_commit_sqe(sq);
 
-        return DISK_RET_EBADTRACK;
+    /* Reap the completions of all submitted commands. */
+    while (cmds--) {
+        struct nvme_cqe cqe = nvme_wait(sq);
+
+        if (!nvme_is_cqe_success(&cqe)) {
+            dprintf(2, "read io: %08x %08x %08x %08x\n",
+                    cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+
+            res = DISK_RET_EBADTRACK;
+        }
     }
 
-    return DISK_RET_SUCCESS;
+    return res;
 }
 
 static int
@@ -549,6 +607,7 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
             identify->nn, (identify->nn == 1) ? "" : "s");
 
     ctrl->ns_count = identify->nn;
+    ctrl->mdts = identify->mdts;
     free(identify);
 
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
@@ -644,8 +703,10 @@ nvme_scan(void)
     }
 }
 
+/* Transfer a request that isn't dword aligned through the bounce buffer. */
 static int
-nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+nvme_bounce_readwrite(struct nvme_namespace *ns, struct disk_op_s *op,
+                      int write)
 {
     int res = DISK_RET_SUCCESS;
     u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
@@ -676,6 +737,38 @@ nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
     return res;
 }
 
+static int
+nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+{
+    if ((u32)op->buf_fl & 0x3)
+        return nvme_bounce_readwrite(ns, op, write);
+
+    /* Transfer as much as fits into the PRP list and the I/O queue at a
+       time. */
+    int res = DISK_RET_SUCCESS;
+    u32 max_blocks = NVME_MAX_PRPL_ENTRIES * NVME_PAGE_SIZE / ns->block_size;
+    u32 max_queued = ns->max_req_size * ns->ctrl->io_sq.common.mask;
+    if (max_queued < max_blocks)
+        max_blocks = max_queued;
+    u16 i;
+
+    for (i = 0; i < op->count && res == DISK_RET_SUCCESS;) {
+        u16 blocks_remaining = op->count - i;
+        u16 blocks = blocks_remaining < max_blocks ? blocks_remaining
+                                                   : max_blocks;
+        char *op_buf = op->buf_fl + i * ns->block_size;
+
+        res = nvme_io_readwrite(ns, op->lba + i, op_buf, blocks, write);
+        dprintf(3, "ns %u %s lba %llu+%u: %d\n", ns->ns_id, write ? "write"
+                                                                  : "read",
+                op->lba + i, blocks, res);
+
+        i += blocks;
+    }
+
+    return res;
+}
+
 int
 nvme_process_op(struct disk_op_s *op)
 {
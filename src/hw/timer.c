@@ -143,7 +143,7 @@ timer_adjust_bits(u32 value, u32 validbits)
 }
 
 // Sample the current timer value.
-static u32
+u32
 timer_read(void)
 {
     u16 port = GET_GLOBAL(TimerPort);
@@ -182,6 +182,16 @@ timer_calc_nsec(u32 nsecs)
     return cur + DIV_ROUND_UP(nsecs * khz, 1000000);
 }
 
+// Return the number of microseconds in 'time' timer units.
+u32
+timer_to_usec(u32 time)
+{
+    u32 khz = GET_GLOBAL(TimerKHz);
+    if (time > 0xffffffff / 1000)
+        return time / khz * 1000;
+    return time * 1000 / khz;
+}
+
 // Check if the current time is past a previously calculated end time.
 int
 timer_check(u32 end)
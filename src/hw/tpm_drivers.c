@@ -9,9 +9,13 @@
 
 #include "byteorder.h" // be32_to_cpu
 #include "config.h" // CONFIG_TPM_TIS_SHA1THRESHOLD
+#include "fw/paravirt.h" // qemu_cfg_write_file
+#include "hw/pic.h" // pic_irqmask_mask
 #include "hw/tpm_drivers.h" // struct tpm_driver
+#include "malloc.h" // malloc_tmp
 #include "std/tcg.h" // TCG_RESPONSE_TIMEOUT
 #include "output.h" // warn_timeout
+#include "romfile.h" // romfile_find
 #include "stacks.h" // yield
 #include "string.h" // memcpy
 #include "util.h" // timer_calc_usec
@@ -31,6 +35,8 @@ struct tpm_driver {
     u32 (*readresp)(u8 *buffer, u32 *len);
     u32 (*waitdatavalid)(void);
     u32 (*waitrespready)(enum tpmDurationType to_t);
+    void (*set_irq)(u8 irq);
+    u32 (*ack_irq)(void);
 };
 
 extern struct tpm_driver tpm_drivers[];
@@ -58,22 +64,45 @@ static const u32 tpm_default_durations[3] = {
 static u32 tpm_default_dur[3];
 static u32 tpm_default_to[4];
 
+/* multi-byte accesses to the TIS data FIFO are supported */
+static u8 tis_fifo_wide;
+
 static u32 crb_cmd_size;
 static void *crb_cmd;
 static u32 crb_resp_size;
 static void *crb_resp;
 
+/* the irq the TPM signals events on; 0 if the TPM is polled */
+static u8 tpm_irq;
+/* the TPM changed its state without raising the irq */
+static u8 tpm_irq_missed;
+
+static u32 tpm_ack_irq(void);
+
 static u32 wait_reg8(u8* reg, u32 time, u8 mask, u8 expect)
 {
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    u32 rc = 1;
+    u32 rc = 1, irqsts = 0;
     u32 end = timer_calc_usec(time);
+    u8 slept = 0;
 
     for (;;) {
+        /* acknowledge before reading so no event can get lost */
+        if (tpm_irq)
+            irqsts = tpm_ack_irq();
         u8 value = readl(reg);
         if ((value & mask) == expect) {
+            /*
+             * The state may have changed after the acknowledgement, so look
+             * again before concluding the TPM doesn't raise its irq;
+             * without it every wait would sleep until the next timer tick.
+             */
+            if (slept && !irqsts && !tpm_ack_irq()) {
+                dprintf(1, "TPM: irq %d not raised, polling\n", tpm_irq);
+                tpm_irq_missed = 1;
+            }
             rc = 0;
             break;
         }
@@ -81,7 +110,13 @@ static u32 wait_reg8(u8* reg, u32 time, u8 mask, u8 expect)
             warn_timeout();
             break;
         }
-        yield();
+        /* sleep until the TPM (or the timer) raises an irq */
+        if (tpm_irq && !tpm_irq_missed) {
+            yield_toirq();
+            slept = 1;
+        } else {
+            yield();
+        }
     }
     return rc;
 }
@@ -186,6 +221,13 @@ static u32 tis_init(void)
 
     writeb(TIS_REG(0, TIS_REG_INT_ENABLE), 0);
 
+    /*
+     * Interfaces reporting a data transfer size (TIS 1.3 and PTP) allow
+     * accessing the 4 bytes of the data FIFO register at once
+     */
+    u32 cap = readl(TIS_REG(0, TIS_REG_INTF_CAPABILITY));
+    tis_fifo_wide = (cap & TIS_CAP_DATA_TRANSFER_SIZE) != 0;
+
     init_timeout(TIS_DRIVER_IDX);
 
     return 1;
@@ -271,49 +313,64 @@ static u32 tis_ready(void)
     return rc;
 }
 
+/* wait for the TPM to report a non-zero burst count */
+static u16 tis_wait_burst(u8 locty, u32 end)
+{
+    for (;;) {
+        u16 burst = readl(TIS_REG(locty, TIS_REG_STS)) >> 8;
+        if (burst)
+            return burst;
+        if (timer_check(end)) {
+            warn_timeout();
+            return 0;
+        }
+        yield();
+    }
+}
+
+static void tis_fifo_write(u8 locty, const u8 *data, u32 len)
+{
+    void *fifo = TIS_REG(locty, TIS_REG_DATA_FIFO);
+
+    if (tis_fifo_wide)
+        for (; len >= 4; len -= 4, data += 4)
+            writel(fifo, *(u32 *)data);
+    for (; len; len--)
+        writeb(fifo, *data++);
+}
+
+static void tis_fifo_read(u8 locty, u8 *buffer, u32 len)
+{
+    void *fifo = TIS_REG(locty, TIS_REG_DATA_FIFO);
+
+    if (tis_fifo_wide)
+        for (; len >= 4; len -= 4, buffer += 4)
+            *(u32 *)buffer = readl(fifo);
+    for (; len; len--)
+        *buffer++ = readb(fifo);
+}
+
 static u32 tis_senddata(const u8 *const data, u32 len)
 {
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    u32 rc = 0;
     u32 offset = 0;
-    u32 end_loop = 0;
-    u16 burst = 0;
     u8 locty = tis_find_active_locality();
     u32 timeout_d = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_D];
     u32 end = timer_calc_usec(timeout_d);
 
-    do {
-        while (burst == 0) {
-               burst = readl(TIS_REG(locty, TIS_REG_STS)) >> 8;
-            if (burst == 0) {
-                if (timer_check(end)) {
-                    warn_timeout();
-                    break;
-                }
-                yield();
-            }
-        }
-
-        if (burst == 0) {
-            rc = TCG_RESPONSE_TIMEOUT;
-            break;
-        }
-
-        while (1) {
-            writeb(TIS_REG(locty, TIS_REG_DATA_FIFO), data[offset++]);
-            burst--;
-
-            if (burst == 0 || offset == len)
-                break;
-        }
-
-        if (offset == len)
-            end_loop = 1;
-    } while (end_loop == 0);
+    while (offset < len) {
+        u32 count = tis_wait_burst(locty, end);
+        if (count == 0)
+            return TCG_RESPONSE_TIMEOUT;
+        if (count > len - offset)
+            count = len - offset;
+        tis_fifo_write(locty, data + offset, count);
+        offset += count;
+    }
 
-    return rc;
+    return 0;
 }
 
 static u32 tis_readresp(u8 *buffer, u32 *len)
@@ -321,23 +378,45 @@ static u32 tis_readresp(u8 *buffer, u32 *len)
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    u32 rc = 0;
     u32 offset = 0;
-    u32 sts;
+    u32 size = *len;
     u8 locty = tis_find_active_locality();
+    u32 timeout_c = tpm_drivers[TIS_DRIVER_IDX].timeouts[TIS_TIMEOUT_TYPE_C];
+    u32 end = timer_calc_usec(timeout_c);
 
-    while (offset < *len) {
-        buffer[offset] = readb(TIS_REG(locty, TIS_REG_DATA_FIFO));
-        offset++;
-        sts = readb(TIS_REG(locty, TIS_REG_STS));
+    while (offset < size) {
+        u32 sts = readl(TIS_REG(locty, TIS_REG_STS));
         /* data left ? */
         if ((sts & TIS_STS_DATA_AVAILABLE) == 0)
             break;
+        u32 count = (u16)(sts >> 8);
+        if (count == 0) {
+            if (timer_check(end)) {
+                warn_timeout();
+                break;
+            }
+            yield();
+            continue;
+        }
+        if (count > size - offset)
+            count = size - offset;
+        /* fetch the header first to learn the size of the response */
+        if (offset < 6 && count > 6 - offset)
+            count = 6 - offset;
+        tis_fifo_read(locty, buffer + offset, count);
+        offset += count;
+        if (offset == 6) {
+            u32 expected = be32_to_cpu(*(u32 *)&buffer[2]);
+            if (expected < 6)
+                break;
+            if (expected < size)
+                size = expected;
+        }
     }
 
     *len = offset;
 
-    return rc;
+    return 0;
 }
 
 
@@ -356,6 +435,33 @@ static u32 tis_waitdatavalid(void)
     return rc;
 }
 
+static void tis_set_irq(u8 irq)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    if (!irq) {
+        writel(TIS_REG(0, TIS_REG_INT_ENABLE), 0);
+        return;
+    }
+    writeb(TIS_REG(0, TIS_REG_INT_VECTOR), irq);
+    writel(TIS_REG(0, TIS_REG_INT_ENABLE),
+           TIS_INT_GLOBAL_ENABLE | TIS_INT_RISING_EDGE |
+           TIS_INT_DATA_AVAILABLE | TIS_INT_STS_VALID |
+           TIS_INT_LOCALITY_CHANGE | TIS_INT_COMMAND_READY);
+}
+
+static u32 tis_ack_irq(void)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    u32 sts = readl(TIS_REG(0, TIS_REG_INT_STATUS));
+    if (sts)
+        writel(TIS_REG(0, TIS_REG_INT_STATUS), sts);
+    return sts;
+}
+
 static u32 tis_waitrespready(enum tpmDurationType to_t)
 {
     if (!CONFIG_TCGBIOS)
@@ -482,12 +588,32 @@ static u32 crb_senddata(const u8 *const data, u32 len)
         return 1;
 
     u8 locty = crb_find_active_locality();
-    memcpy(crb_cmd, data, len);
+    if (data != crb_cmd)
+        memcpy(crb_cmd, data, len);
     writel(CRB_REG(locty, CRB_REG_CTRL_START), CRB_START_INVOKE);
 
     return 0;
 }
 
+/* check the response in the response buffer and return its length */
+static u32 crb_resp_inplace(u32 *len)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    u8 locty = crb_find_active_locality();
+    if (readl(CRB_REG(locty, CRB_REG_CTRL_STS)) & CRB_CTRL_STS_ERROR)
+        return 1;
+
+    u32 expected = be32_to_cpu(*(u32 *)(crb_resp + 2));
+    if (expected < 6 || expected > crb_resp_size)
+        return 1;
+
+    *len = expected;
+
+    return 0;
+}
+
 static u32 crb_readresp(u8 *buffer, u32 *len)
 {
     if (!CONFIG_TCGBIOS)
@@ -533,6 +659,32 @@ static u32 crb_waitrespready(enum tpmDurationType to_t)
     return rc;
 }
 
+#define CRB_INT_START 0b1
+#define CRB_INT_CMD_READY 0b10
+#define CRB_INT_GLOBAL_ENABLE (1 << 31)
+
+static void crb_set_irq(u8 irq)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    /* the irq of a CRB interface is fixed by the platform */
+    writel(CRB_REG(0, CRB_REG_INT_ENABLE),
+           irq ? CRB_INT_GLOBAL_ENABLE | CRB_INT_START | CRB_INT_CMD_READY
+               : 0);
+}
+
+static u32 crb_ack_irq(void)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    u32 sts = readl(CRB_REG(0, CRB_REG_INT_STS));
+    if (sts)
+        writel(CRB_REG(0, CRB_REG_INT_STS), sts);
+    return sts;
+}
+
 struct tpm_driver tpm_drivers[TPM_NUM_DRIVERS] = {
     [TIS_DRIVER_IDX] =
         {
@@ -548,6 +700,8 @@ struct tpm_driver tpm_drivers[TPM_NUM_DRIVERS] = {
             .readresp      = tis_readresp,
             .waitdatavalid = tis_waitdatavalid,
             .waitrespready = tis_waitrespready,
+            .set_irq       = tis_set_irq,
+            .ack_irq       = tis_ack_irq,
         },
     [CRB_DRIVER_IDX] =
         {
@@ -563,6 +717,8 @@ struct tpm_driver tpm_drivers[TPM_NUM_DRIVERS] = {
             .readresp      = crb_readresp,
             .waitdatavalid = crb_waitdatavalid,
             .waitrespready = crb_waitrespready,
+            .set_irq       = crb_set_irq,
+            .ack_irq       = crb_ack_irq,
         },
 };
 
@@ -589,14 +745,86 @@ tpmhw_is_present(void)
     return TPMHW_driver_to_use != TPM_INVALID_DRIVER;
 }
 
-int
-tpmhw_transmit(u8 locty, struct tpm_req_header *req,
-               void *respbuffer, u32 *respbufferlen,
-               enum tpmDurationType to_t)
+#define TPM_STATS_MAX 32
+
+static struct tpm_stats_table *tpm_stats;
+static u8 tpm_stats_published;
+
+/* account a command that took 'usec' microseconds; only used in POST */
+void VISIBLE32INIT
+tpm_stats_record(u32 ordinal, u32 usec)
 {
-    if (TPMHW_driver_to_use == TPM_INVALID_DRIVER)
-        return -1;
+    if (!tpm_stats) {
+        u32 size = sizeof(*tpm_stats)
+                   + TPM_STATS_MAX * sizeof(tpm_stats->stats[0]);
+        tpm_stats = malloc_tmp(size);
+        if (!tpm_stats)
+            return;
+        memset(tpm_stats, 0, size);
+        memcpy(tpm_stats->signature, TPM_STATS_SIGNATURE,
+               sizeof(tpm_stats->signature));
+    }
 
+    struct tpm_ordinal_stats *st = tpm_stats->stats;
+    struct tpm_ordinal_stats *end = st + tpm_stats->count;
+    while (st < end && st->ordinal != ordinal)
+        st++;
+    if (st == end) {
+        if (tpm_stats->count >= TPM_STATS_MAX)
+            return;
+        tpm_stats->count++;
+        st->ordinal = ordinal;
+        st->min_usec = usec;
+    }
+
+    st->count++;
+    if (usec < st->min_usec)
+        st->min_usec = usec;
+    if (usec > st->max_usec)
+        st->max_usec = usec;
+    st->total_usec += usec;
+}
+
+/* dump the command statistics and make them available to the host */
+void
+tpmhw_publish_stats(void)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    struct tpm_stats_table *ts = tpm_stats;
+    tpm_stats_published = 1;
+    tpm_stats = NULL;
+    if (!ts)
+        return;
+
+    ts->size = sizeof(*ts) + ts->count * sizeof(ts->stats[0]);
+
+    dprintf(DEBUG_tcg_stats, "TPM command statistics:\n");
+    dprintf(DEBUG_tcg_stats, "  ordinal    count  min(us)  max(us) total(us)\n");
+    u32 i;
+    for (i = 0; i < ts->count; i++) {
+        struct tpm_ordinal_stats *st = &ts->stats[i];
+        dprintf(DEBUG_tcg_stats, "  %08x %8d %8d %8d %9d\n", st->ordinal,
+                st->count, st->min_usec, st->max_usec, st->total_usec);
+    }
+
+    struct romfile_s *file = romfile_find("etc/tpm-stats");
+    if (file)
+        qemu_cfg_write_file(ts, file, 0,
+                            ts->size < file->size ? ts->size : file->size);
+
+    free(ts);
+}
+
+/* serializes the commands of the threads talking to the TPM */
+struct mutex_s tpm_transmit_lock VARLOW;
+
+static int
+__tpmhw_transmit(u8 locty, struct tpm_req_header *req,
+                 void *respbuffer, u32 *respbufferlen, void **resp,
+                 enum tpmDurationType to_t)
+{
     struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
 
     u32 irc = td->activate(locty);
@@ -617,18 +845,131 @@ tpmhw_transmit(u8 locty, struct tpm_req_header *req,
     if (irc != 0)
         return -1;
 
-    irc = td->readresp(respbuffer, respbufferlen);
+    if (resp && (void*)req == crb_cmd) {
+        /* leave the response where the TPM wrote it */
+        irc = crb_resp_inplace(respbufferlen);
+        *resp = crb_resp;
+    } else {
+        irc = td->readresp(respbuffer, respbufferlen);
+        if (resp)
+            *resp = respbuffer;
+    }
     if (irc != 0)
         return -1;
 
-    td->ready();
-
     return 0;
 }
 
+static int
+tpm_transmit_stats(u8 locty, struct tpm_req_header *req,
+                   void *respbuffer, u32 *respbufferlen, void **resp,
+                   enum tpmDurationType to_t)
+{
+    u32 ordinal = be32_to_cpu(req->ordinal);
+    u32 start = timer_read();
+    int ret = __tpmhw_transmit(locty, req, respbuffer, respbufferlen, resp,
+                               to_t);
+    if (!tpm_stats_published && in_post())
+        tpm_stats_record(ordinal, timer_to_usec(timer_read() - start));
+    return ret;
+}
+
+int
+tpmhw_transmit(u8 locty, struct tpm_req_header *req,
+               void *respbuffer, u32 *respbufferlen,
+               enum tpmDurationType to_t)
+{
+    if (TPMHW_driver_to_use == TPM_INVALID_DRIVER)
+        return -1;
+
+    mutex_lock(&tpm_transmit_lock);
+    int ret = tpm_transmit_stats(locty, req, respbuffer, respbufferlen, NULL,
+                                 to_t);
+    if (!ret)
+        tpm_drivers[TPMHW_driver_to_use].ready();
+    mutex_unlock(&tpm_transmit_lock);
+    return ret;
+}
+
+/*
+ * Commands built in place: on a CRB interface a command of 'size' bytes
+ * is built directly in the command buffer of the TPM and its response
+ * is parsed where the TPM wrote it. Returns the buffer to build the
+ * command in; this is 'buf' if the interface does not support this.
+ * Every call must be followed by tpmhw_cmd_transmit() and then
+ * tpmhw_cmd_end() once the response is no longer needed.
+ */
+u8 tpm_cmd_done VARLOW;
+
+void *
+tpmhw_cmd_begin(void *buf, u32 size)
+{
+    mutex_lock(&tpm_transmit_lock);
+    tpm_cmd_done = 0;
+    if (TPMHW_driver_to_use == CRB_DRIVER_IDX && size <= crb_cmd_size)
+        return crb_cmd;
+    return buf;
+}
+
+/*
+ * Send a command from tpmhw_cmd_begin(); '*resp' is set to the response,
+ * which is either in the TPM's response buffer or in 'respbuffer'
+ */
+int
+tpmhw_cmd_transmit(u8 locty, struct tpm_req_header *req,
+                   void *respbuffer, u32 *respbufferlen, void **resp,
+                   enum tpmDurationType to_t)
+{
+    if (TPMHW_driver_to_use == TPM_INVALID_DRIVER)
+        return -1;
+
+    int ret = tpm_transmit_stats(locty, req, respbuffer, respbufferlen, resp,
+                                 to_t);
+    tpm_cmd_done = !ret;
+    return ret;
+}
+
+void
+tpmhw_cmd_end(void)
+{
+    if (tpm_cmd_done)
+        tpm_drivers[TPMHW_driver_to_use].ready();
+    mutex_unlock(&tpm_transmit_lock);
+}
+
 void
 tpmhw_set_timeouts(u32 timeouts[4], u32 durations[3])
 {
     struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
     td->set_timeouts(timeouts, durations);
 }
+
+static u32 tpm_ack_irq(void)
+{
+    struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
+    return td->ack_irq();
+}
+
+/*
+ * Let the TPM signal events on the given irq so that waiting for it can
+ * sleep instead of polling; an irq of 0 switches back to polling
+ */
+void
+tpmhw_set_irq(u8 irq)
+{
+    if (!CONFIG_HARDWARE_IRQ || TPMHW_driver_to_use == TPM_INVALID_DRIVER
+        || irq >= 16 || irq == 2 || irq == tpm_irq)
+        return;
+
+    struct tpm_driver *td = &tpm_drivers[TPMHW_driver_to_use];
+    if (tpm_irq)
+        pic_irqmask_mask(0, 1 << tpm_irq);
+    td->set_irq(irq);
+    tpm_irq = irq;
+    tpm_irq_missed = 0;
+    if (irq) {
+        td->ack_irq();
+        /* the default irq handler acknowledges the irq at the pic */
+        pic_irqmask_mask(1 << irq, 0);
+    }
+}
@@ -22,7 +22,35 @@ struct tpm_req_header;
 int tpmhw_transmit(u8 locty, struct tpm_req_header *req,
                    void *respbuffer, u32 *respbufferlen,
                    enum tpmDurationType to_t);
+void *tpmhw_cmd_begin(void *buf, u32 size);
+int tpmhw_cmd_transmit(u8 locty, struct tpm_req_header *req,
+                       void *respbuffer, u32 *respbufferlen, void **resp,
+                       enum tpmDurationType to_t);
+void tpmhw_cmd_end(void);
 void tpmhw_set_timeouts(u32 timeouts[4], u32 durations[3]);
+void tpmhw_set_irq(u8 irq);
+void tpmhw_publish_stats(void);
+
+/*
+ * Statistics of the TPM commands sent during POST, published in the
+ * fw_cfg file "etc/tpm-stats" if the host provides it
+ */
+#define TPM_STATS_SIGNATURE "TPMSTATS"
+
+struct tpm_ordinal_stats {
+    u32 ordinal;
+    u32 count;
+    u32 min_usec;
+    u32 max_usec;
+    u32 total_usec;
+} PACKED;
+
+struct tpm_stats_table {
+    char signature[8];
+    u32 size;
+    u32 count;
+    struct tpm_ordinal_stats stats[0];
+} PACKED;
 
 /* CRB driver */
 /* address of locality 0 (CRB) */
@@ -76,6 +104,15 @@ void tpmhw_set_timeouts(u32 timeouts[4], u32 durations[3]);
 #define TIS_STS_EXPECT                 (1 << 3) /* 0x08 */
 #define TIS_STS_RESPONSE_RETRY         (1 << 1) /* 0x02 */
 
+#define TIS_INT_DATA_AVAILABLE         (1 << 0) /* 0x01 */
+#define TIS_INT_STS_VALID              (1 << 1) /* 0x02 */
+#define TIS_INT_LOCALITY_CHANGE        (1 << 2) /* 0x04 */
+#define TIS_INT_RISING_EDGE            (2 << 3) /* 0x10 */
+#define TIS_INT_COMMAND_READY          (1 << 7) /* 0x80 */
+#define TIS_INT_GLOBAL_ENABLE          (1 << 31)
+
+#define TIS_CAP_DATA_TRANSFER_SIZE     (3 << 9) /* 0x600 */
+
 #define TIS_ACCESS_TPM_REG_VALID_STS   (1 << 7) /* 0x80 */
 #define TIS_ACCESS_ACTIVE_LOCALITY     (1 << 5) /* 0x20 */
 #define TIS_ACCESS_BEEN_SEIZED         (1 << 4) /* 0x10 */
@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // bootprio_find_pci_device
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-blk.h"
@@ -27,45 +27,50 @@ struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    struct vring_list *sg;      // header, data segments and status
+    u32 size_max;               // max bytes per data segment (0 = no limit)
+    u16 max_count;              // max sectors per request
 };
 
 static int
-virtio_blk_op(struct disk_op_s *op, int write)
+virtio_blk_rw(struct virtiodrive_s *vdrive, u64 lba, char *buf, u16 count,
+              int write)
 {
-    struct virtiodrive_s *vdrive =
-        container_of(op->drive_fl, struct virtiodrive_s, drive);
     struct vring_virtqueue *vq = vdrive->vq;
     struct virtio_blk_outhdr hdr = {
         .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
         .ioprio = 0,
-        .sector = op->lba,
+        .sector = lba,
     };
     u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
+
+    /* Split the data into segments of at most size_max bytes */
+    struct vring_list *sg = vdrive->sg;
+    u32 size_max = vdrive->size_max;
+    u32 len = vdrive->drive.blksize * count;
+    int num = 1;
+    sg[0].addr = (void*)(&hdr);
+    sg[0].length = sizeof(hdr);
+    while (len) {
+        u32 seglen = (size_max && len > size_max) ? size_max : len;
+        sg[num].addr = buf;
+        sg[num].length = seglen;
+        buf += seglen;
+        len -= seglen;
+        num++;
+    }
+    sg[num].addr = (void*)(&status);
+    sg[num].length = sizeof(status);
 
     /* Add to virtqueue and kick host */
     if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
+        vring_add_buf(vq, sg, num, 1, 0, 0);
     else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
+        vring_add_buf(vq, sg, 1, num, 0, 0);
     vring_kick(&vdrive->vp, vq, 1);
 
     /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    vring_wait_used(vq);
 
     /* Reclaim virtqueue element */
     vring_get_buf(vq, NULL);
@@ -78,6 +83,71 @@ virtio_blk_op(struct disk_op_s *op, int write)
     return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
 }
 
+static int
+virtio_blk_op(struct disk_op_s *op, int write)
+{
+    struct virtiodrive_s *vdrive =
+        container_of(op->drive_fl, struct virtiodrive_s, drive);
+    u16 max_count = vdrive->max_count;
+    char *buf = op->buf_fl;
+    u64 lba = op->lba;
+    u16 remaining = op->count;
+
+    while (remaining) {
+        u16 count = remaining > max_count ? max_count : remaining;
+        int ret = virtio_blk_rw(vdrive, lba, buf, count, write);
+        if (ret)
+            return ret;
+        buf += count * vdrive->drive.blksize;
+        lba += count;
+        remaining -= count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+// Set up the request size limits and the scatter list from the
+// negotiated features.
+static int
+virtio_blk_init_limits(struct virtiodrive_s *vdrive, u64 features,
+                       u32 size_max, u32 seg_max)
+{
+    // A descriptor chain may not be longer than the queue.
+    u32 segs = vdrive->vq->vring.num - 2;
+    if ((features & (1 << VIRTIO_BLK_F_SEG_MAX)) && seg_max && seg_max < segs)
+        segs = seg_max;
+
+    u32 blksize = vdrive->drive.blksize;
+    u32 max_count = 0xffff;
+    if ((features & (1 << VIRTIO_BLK_F_SIZE_MAX)) && size_max) {
+        vdrive->size_max = size_max;
+        u32 seg_blocks = size_max / blksize;
+        if (!seg_blocks)
+            max_count = size_max * segs / blksize;
+        else if (seg_blocks <= max_count / segs)
+            max_count = seg_blocks * segs;
+    } else {
+        segs = 1;
+    }
+    if (!max_count) {
+        dprintf(1, "virtio-blk size_max %d too small\n", size_max);
+        return -1;
+    }
+    vdrive->max_count = max_count;
+
+    vdrive->sg = malloc_high(sizeof(*vdrive->sg) * (segs + 2));
+    if (!vdrive->sg) {
+        warn_noalloc();
+        return -1;
+    }
+    if (features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)
+        && vring_init_indirect(vdrive->vq, segs + 2))
+        return -1;
+
+    dprintf(3, "virtio-blk size_max=%d segs=%d max_count=%d indirect=%d\n",
+            vdrive->size_max, segs, max_count, !!vdrive->vq->indirect);
+    return 0;
+}
+
 int
 virtio_blk_process_op(struct disk_op_s *op)
 {
@@ -109,23 +179,26 @@ init_virtio_blk(void *data)
     vdrive->drive.cntl_id = pci->bdf;
 
     vp_init_simple(&vdrive->vp, pci);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
-        goto fail;
-    }
 
+    u64 features;
+    u32 size_max, seg_max;
     if (vdrive->vp.use_modern) {
         struct vp_device *vp = &vdrive->vp;
-        u64 features = vp_get_features(vp);
+        features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+        u64 limits = ((1ull << VIRTIO_BLK_F_SIZE_MAX)
+                      | (1ull << VIRTIO_BLK_F_SEG_MAX));
+        u64 indirect = 1ull << VIRTIO_RING_F_INDIRECT_DESC;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        features = features & (version1 | iommu_platform | blk_size);
+        features = features & (version1 | iommu_platform | blk_size
+                               | limits | indirect | packed);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -156,12 +229,20 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, heads);
         vdrive->drive.pchs.sector =
             vp_read(&vp->device, struct virtio_blk_config, sectors);
+
+        size_max = vp_read(&vp->device, struct virtio_blk_config, size_max);
+        seg_max = vp_read(&vp->device, struct virtio_blk_config, seg_max);
     } else {
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
 
-        u64 f = vp_get_features(&vdrive->vp);
-        vdrive->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
+        features = vp_get_features(&vdrive->vp);
+        features &= ((1 << VIRTIO_BLK_F_BLK_SIZE)
+                     | (1 << VIRTIO_BLK_F_SIZE_MAX)
+                     | (1 << VIRTIO_BLK_F_SEG_MAX)
+                     | (1 << VIRTIO_RING_F_INDIRECT_DESC));
+        vp_set_features(&vdrive->vp, features);
+        vdrive->drive.blksize = (features & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
             cfg.blk_size : DISK_SECTOR_SIZE;
 
         vdrive->drive.sectors = cfg.capacity;
@@ -176,8 +257,18 @@ init_virtio_blk(void *data)
         vdrive->drive.pchs.cylinder = cfg.cylinders;
         vdrive->drive.pchs.head = cfg.heads;
         vdrive->drive.pchs.sector = cfg.sectors;
+        size_max = cfg.size_max;
+        seg_max = cfg.seg_max;
     }
 
+    /* The queue layout depends on the negotiated features (packed ring) */
+    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
+        goto fail;
+    }
+    if (virtio_blk_init_limits(vdrive, features, size_max, seg_max))
+        goto fail;
+
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_pci_device(pci));
 
@@ -187,6 +278,9 @@ init_virtio_blk(void *data)
 
 fail:
     vp_reset(&vdrive->vp);
+    if (vdrive->vq)
+        free(vdrive->vq->indirect);
+    free(vdrive->sg);
     free(vdrive->vq);
     free(vdrive);
 }
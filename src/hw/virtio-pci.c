@@ -213,6 +213,7 @@ void vp_set_features(struct vp_device *vp, u64 features)
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature, f0);
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature_select, 1);
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature, f1);
+        vp->use_packed = !!(features & (1ull << VIRTIO_F_RING_PACKED));
     } else {
         vp_write(&vp->legacy, virtio_pci_legacy, guest_features, f0);
     }
@@ -347,22 +348,33 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
 
    /* initialize the queue */
    struct vring * vr = &vq->vring;
-   vring_init(vr, num, (unsigned char*)&vq->queue);
+   void *desc, *driver, *device;
+   if (vp->use_packed) {
+       vring_init_packed(vq, num, (unsigned char*)&vq->queue);
+       desc = vq->packed_desc;
+       driver = vq->driver_event;
+       device = vq->device_event;
+   } else {
+       vring_init(vr, num, (unsigned char*)&vq->queue);
+       desc = vr->desc;
+       driver = vr->avail;
+       device = vr->used;
+   }
 
    /* activate the queue
     *
-    * NOTE: vr->desc is initialized by vring_init()
+    * NOTE: desc is initialized by vring_init() or vring_init_packed()
     */
 
    if (vp->use_modern) {
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_lo,
-                (unsigned long)virt_to_phys(vr->desc));
+                (unsigned long)virt_to_phys(desc));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_lo,
-                (unsigned long)virt_to_phys(vr->avail));
+                (unsigned long)virt_to_phys(driver));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_lo,
-                (unsigned long)virt_to_phys(vr->used));
+                (unsigned long)virt_to_phys(device));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_enable, 1);
        vq->queue_notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
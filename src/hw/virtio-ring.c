@@ -16,15 +16,120 @@
  *
  */
 
+#include "malloc.h" // memalign_high
 #include "output.h" // panic
+#include "stacks.h" // yield
+#include "string.h" // memset
 #include "virtio-ring.h"
 #include "virtio-pci.h"
+#include "x86.h" // cpu_relax
 
 #define BUG() do {                                                      \
             panic("BUG: failure at %d/%s()!\n", __LINE__, __func__);    \
         } while (0)
 #define BUG_ON(condition) do { if (condition) BUG(); } while (0)
 
+/*
+ * Packed ring helpers
+ *
+ * A descriptor is available when its AVAIL flag matches the driver's
+ * wrap counter and its USED flag doesn't; the device marks it used by
+ * making both flags equal to its own wrap counter.
+ *
+ */
+
+static u16 vring_packed_flags(u8 wrap)
+{
+    return wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+}
+
+static int vring_packed_more_used(struct vring_virtqueue *vq)
+{
+    u16 flags = vq->packed_desc[vq->last_used_idx].flags;
+    int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    int used = !!(flags & VRING_PACKED_DESC_F_USED);
+    /* Make sure descriptor reads are done after flags read above. */
+    smp_rmb();
+    return avail == used && used == vq->used_wrap;
+}
+
+static int vring_packed_get_buf(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed_desc *desc = &vq->packed_desc[vq->last_used_idx];
+    u16 id = desc->id;
+    if (len != NULL)
+        *len = desc->len;
+
+    /* Skip over all descriptors of the returned chain */
+    u16 last = vq->last_used_idx + vq->chain_num[id];
+    if (last >= vq->vring.num) {
+        last -= vq->vring.num;
+        vq->used_wrap ^= 1;
+    }
+    vq->last_used_idx = last;
+
+    return vq->vdata[id];
+}
+
+static void vring_packed_add_buf(struct vring_virtqueue *vq,
+                                 struct vring_list list[],
+                                 unsigned int out, unsigned int in, int index)
+{
+    struct vring_packed_desc *desc = vq->packed_desc;
+    unsigned int num = vq->vring.num, total = out + in, chain = total, n;
+    u16 head = vq->next_avail, i = head, head_flags = 0;
+    u8 wrap = vq->avail_wrap;
+
+    if (vq->indirect && total > 1) {
+        /* Place the whole chain in the indirect table */
+        struct vring_packed_desc *table = (void*)vq->indirect;
+        BUG_ON(total > vq->indirect_num);
+        for (n = 0; n < total; n++, list++) {
+            table[n].addr = (u64)virt_to_phys(list->addr);
+            table[n].len = list->length;
+            table[n].id = 0;
+            table[n].flags = n < out ? 0 : VRING_DESC_F_WRITE;
+        }
+        desc[i].addr = (u64)virt_to_phys(table);
+        desc[i].len = total * sizeof(*table);
+        desc[i].id = head;
+        head_flags = VRING_DESC_F_INDIRECT | vring_packed_flags(wrap);
+        chain = 1;
+        if (++i >= num) {
+            i = 0;
+            wrap ^= 1;
+        }
+    } else {
+        for (n = 0; n < total; n++, list++) {
+            u16 flags = vring_packed_flags(wrap);
+            if (n + 1 < total)
+                flags |= VRING_DESC_F_NEXT;
+            if (n >= out)
+                flags |= VRING_DESC_F_WRITE;
+            desc[i].addr = (u64)virt_to_phys(list->addr);
+            desc[i].len = list->length;
+            desc[i].id = head;
+            if (n)
+                desc[i].flags = flags;
+            else
+                head_flags = flags;
+            if (++i >= num) {
+                i = 0;
+                wrap ^= 1;
+            }
+        }
+    }
+
+    vq->next_avail = i;
+    vq->avail_wrap = wrap;
+    vq->chain_num[head] = chain;
+    vq->vdata[head] = index;
+
+    /* Make the chain visible to the device only once it is complete. */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
 /*
  * vring_more_used
  *
@@ -34,6 +139,9 @@
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (vq->packed)
+        return vring_packed_more_used(vq);
+
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -41,6 +149,49 @@ int vring_more_used(struct vring_virtqueue *vq)
     return more;
 }
 
+/*
+ * vring_wait_used
+ *
+ * wait for the device to return a buffer: spin on the used index for
+ * a while and then fall back to yield() so irqs and other threads can
+ * make progress.  The spin budget grows while completions arrive
+ * within it and shrinks when they don't.
+ *
+ */
+
+#define VRING_SPIN_MIN 64
+#define VRING_SPIN_MAX 8192
+
+void vring_wait_used(struct vring_virtqueue *vq)
+{
+    u32 limit = vq->spin_limit;
+    u32 spins = 0, yields = 0;
+
+    if (limit < VRING_SPIN_MIN)
+        limit = VRING_SPIN_MIN;
+    while (!vring_more_used(vq)) {
+        if (spins < limit) {
+            spins++;
+            cpu_relax();
+        } else {
+            yields++;
+            yield();
+        }
+    }
+
+    if (!yields) {
+        if (limit < VRING_SPIN_MAX)
+            limit *= 2;
+    } else if (limit > VRING_SPIN_MIN) {
+        limit /= 2;
+    }
+    vq->spin_limit = limit;
+    vq->stat_spins += spins;
+    vq->stat_yields += yields;
+    dprintf(9, "vq %p wait: %u spins %u yields (total %u/%u, limit %u)\n",
+            vq, spins, yields, vq->stat_spins, vq->stat_yields, limit);
+}
+
 /*
  * vring_free
  *
@@ -82,6 +233,9 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 
 //    BUG_ON(!vring_more_used(vq));
 
+    if (vq->packed)
+        return vring_packed_get_buf(vq, len);
+
     elem = &used->ring[vq->last_used_idx % vr->num];
     id = elem->id;
     if (len != NULL)
@@ -108,8 +262,36 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     BUG_ON(out + in == 0);
 
-    prev = 0;
+    if (vq->packed) {
+        vring_packed_add_buf(vq, list, out, in, index);
+        return;
+    }
+
     head = vq->free_head;
+    if (vq->indirect && out + in > 1) {
+        /* Place the whole chain in the indirect table and only use the
+         * head descriptor of the ring. */
+        struct vring_desc *table = vq->indirect;
+        unsigned int num = out + in;
+        BUG_ON(num > vq->indirect_num);
+        for (i = 0; i < num; i++, list++) {
+            table[i].flags = VRING_DESC_F_NEXT;
+            if (i >= out)
+                table[i].flags |= VRING_DESC_F_WRITE;
+            table[i].addr = (u64)virt_to_phys(list->addr);
+            table[i].len = list->length;
+            table[i].next = i + 1;
+        }
+        table[num - 1].flags &= ~VRING_DESC_F_NEXT;
+
+        desc[head].flags = VRING_DESC_F_INDIRECT;
+        desc[head].addr = (u64)virt_to_phys(table);
+        desc[head].len = num * sizeof(*table);
+        vq->free_head = desc[head].next;
+        goto add_avail;
+    }
+
+    prev = 0;
     for (i = head; out; i = desc[i].next, out--) {
         desc[i].flags = VRING_DESC_F_NEXT;
         desc[i].addr = (u64)virt_to_phys(list->addr);
@@ -128,6 +310,7 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     vq->free_head = i;
 
+add_avail:
     vq->vdata[head] = index;
 
     av = (avail->idx + num_added) % vr->num;
@@ -141,7 +324,31 @@ void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    avail->idx = avail->idx + num_added;
+    /* Packed ring descriptors are made available by vring_add_buf() */
+    if (!vq->packed)
+        avail->idx = avail->idx + num_added;
 
     vp_notify(vp, vq);
 }
+
+/*
+ * vring_init_indirect
+ *
+ * allocate an indirect descriptor table for chains of up to num
+ * descriptors (requires VIRTIO_RING_F_INDIRECT_DESC)
+ *
+ */
+
+int vring_init_indirect(struct vring_virtqueue *vq, unsigned int num)
+{
+    struct vring_desc *table = memalign_high(sizeof(*table),
+                                             sizeof(*table) * num);
+    if (!table) {
+        warn_noalloc();
+        return -1;
+    }
+    memset(table, 0, sizeof(*table) * num);
+    vq->indirect = table;
+    vq->indirect_num = num;
+    return 0;
+}
@@ -19,16 +19,29 @@
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
+#define VIRTIO_F_RING_PACKED            34
+
+/* Support for indirect descriptors */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
 
 #define MAX_QUEUE_NUM      (128)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+/* Packed ring descriptor flags */
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+/* Packed ring event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+
 struct vring_desc
 {
    u64 addr;
@@ -57,6 +70,20 @@ struct vring_used
    struct vring_used_elem ring[];
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
 struct vring {
    unsigned int num;
    struct vring_desc *desc;
@@ -77,6 +104,22 @@ struct vring_virtqueue {
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   /* Indirect descriptor table (only one request may use it at a time) */
+   struct vring_desc *indirect;
+   u16 indirect_num;
+   /* Completion polling: current spin budget and statistics */
+   u32 spin_limit;
+   u32 stat_spins;
+   u32 stat_yields;
+   /* Packed ring (VIRTIO_F_RING_PACKED) */
+   u8 packed;
+   u8 avail_wrap;
+   u8 used_wrap;
+   u16 next_avail;
+   struct vring_packed_desc *packed_desc;
+   struct vring_packed_desc_event *driver_event;
+   struct vring_packed_desc_event *device_event;
+   u16 chain_num[MAX_QUEUE_NUM];
    /* PCI */
    int queue_index;
    int queue_notify_off;
@@ -109,6 +152,25 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->desc[i].next = 0;
 }
 
+static inline void
+vring_init_packed(struct vring_virtqueue *vq, unsigned int num,
+                  unsigned char *queue)
+{
+   ASSERT32FLAT();
+   vq->vring.num = num;
+   vq->packed = 1;
+   vq->avail_wrap = 1;
+   vq->used_wrap = 1;
+
+   /* descriptor ring and event suppression areas share the queue buffer */
+   vq->packed_desc = (void*)ALIGN((u32)queue, PAGE_SIZE);
+   vq->driver_event = (void*)&vq->packed_desc[num];
+   vq->device_event = &vq->driver_event[1];
+
+   /* disable interrupts */
+   vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+}
+
 struct vp_device;
 int vring_more_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
@@ -117,5 +179,7 @@ void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
+int vring_init_indirect(struct vring_virtqueue *vq, unsigned int num);
+void vring_wait_used(struct vring_virtqueue *vq);
 
 #endif /* _VIRTIO_RING_H_ */
@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep
+#include "util.h" // bootprio_find_scsi_device
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
@@ -76,8 +76,7 @@ virtio_scsi_process_op(struct disk_op_s *op)
     vring_kick(vp, vq, 1);
 
     /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    vring_wait_used(vq);
 
     /* Reclaim virtqueue element */
     vring_get_buf(vq, NULL);
@@ -163,12 +162,13 @@ init_virtio_scsi(void *data)
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        vp_set_features(vp, features & (version1 | iommu_platform | packed));
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
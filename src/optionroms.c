@@ -120,9 +120,11 @@ get_pci_rom(struct rom_header *rom)
     return pd;
 }
 
-// Run rom init code and note rom size.
+// Run rom init code and note rom size. If 'hctx' is given, the rom was
+// already added to it while it was being copied.
 static int
-init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
+init_optionrom(struct rom_header *rom, u16 bdf, int isvga
+               , struct tpm_hash_ctx *hctx)
 {
     if (! is_valid_rom(rom))
         return -1;
@@ -134,7 +136,10 @@ init_optionrom(struct rom_header *rom, u16 bdf, int isvga)
     if (newrom != rom)
         memmove(newrom, rom, rom->size * 512);
 
-    tpm_option_rom(newrom, rom->size * 512);
+    if (hctx && hctx->total == rom->size * 512)
+        tpm_option_rom_hashed(hctx);
+    else
+        tpm_option_rom(newrom, rom->size * 512);
 
     if (isvga || get_pnp_rom(newrom))
         // Only init vga and PnP roms here.
@@ -170,7 +175,7 @@ getRomPriority(u64 *sources, struct rom_header *rom, int instance)
  ****************************************************************/
 
 static struct rom_header *
-deploy_romfile(struct romfile_s *file)
+deploy_romfile(struct romfile_s *file, struct tpm_hash_ctx *hctx)
 {
     u32 size = file->size;
     struct rom_header *rom = rom_reserve(size);
@@ -178,7 +183,11 @@ deploy_romfile(struct romfile_s *file)
         warn_noalloc();
         return NULL;
     }
-    int ret = file->copy(file, rom, size);
+    int ret;
+    if (hctx)
+        ret = romfile_copy_hashed(file, rom, size, hctx);
+    else
+        ret = file->copy(file, rom, size);
     if (ret <= 0)
         return NULL;
     return rom;
@@ -193,10 +202,13 @@ run_file_roms(const char *prefix, int isvga, u64 *sources)
         file = romfile_findprefix(prefix, file);
         if (!file)
             break;
-        struct rom_header *rom = deploy_romfile(file);
+        struct tpm_hash_ctx hctx, *phctx = NULL;
+        if (!tpm_option_rom_start(&hctx))
+            phctx = &hctx;
+        struct rom_header *rom = deploy_romfile(file, phctx);
         if (rom) {
             setRomSource(sources, rom, (u32)file);
-            init_optionrom(rom, 0, isvga);
+            init_optionrom(rom, 0, isvga, phctx);
         }
     }
 }
@@ -224,9 +236,10 @@ is_pci_vga(struct pci_device *pci)
     return 1;
 }
 
-// Copy a rom to its permanent location below 1MiB
+// Copy a rom to its permanent location below 1MiB. If 'hctx' is given,
+// the rom is added to it a chunk at a time as it is being copied.
 static struct rom_header *
-copy_rom(struct rom_header *rom)
+copy_rom(struct rom_header *rom, struct tpm_hash_ctx *hctx)
 {
     u32 romsize = rom->size * 512;
     struct rom_header *newrom = rom_reserve(romsize);
@@ -236,13 +249,24 @@ copy_rom(struct rom_header *rom)
     }
     dprintf(4, "Copying option rom (size %d) from %p to %p\n"
             , romsize, rom, newrom);
-    iomemcpy(newrom, rom, romsize);
+    if (!hctx) {
+        iomemcpy(newrom, rom, romsize);
+        return newrom;
+    }
+    u32 pos;
+    for (pos = 0; pos < romsize; pos += TPM_HASH_CHUNK) {
+        u32 len = romsize - pos;
+        if (len > TPM_HASH_CHUNK)
+            len = TPM_HASH_CHUNK;
+        iomemcpy((void*)newrom + pos, (void*)rom + pos, len);
+        tpm_hash_update(hctx, (void*)newrom + pos, len);
+    }
     return newrom;
 }
 
 // Map the option rom of a given PCI device.
 static struct rom_header *
-map_pcirom(struct pci_device *pci)
+map_pcirom(struct pci_device *pci, struct tpm_hash_ctx *hctx)
 {
     dprintf(6, "Attempting to map option rom on dev %pP\n", pci);
 
@@ -299,7 +323,7 @@ map_pcirom(struct pci_device *pci)
         rom = (void*)((u32)rom + pd->ilen * 512);
     }
 
-    rom = copy_rom(rom);
+    rom = copy_rom(rom, hctx);
     pci_config_writel(bdf, PCI_ROM_ADDRESS, orig);
     return rom;
 fail:
@@ -320,15 +344,18 @@ init_pcirom(struct pci_device *pci, int isvga, u64 *sources)
              , pci->vendor, pci->device);
     struct romfile_s *file = romfile_find(fname);
     struct rom_header *rom = NULL;
+    struct tpm_hash_ctx hctx, *phctx = NULL;
+    if (!tpm_option_rom_start(&hctx))
+        phctx = &hctx;
     if (file)
-        rom = deploy_romfile(file);
+        rom = deploy_romfile(file, phctx);
     else if (RunPCIroms > 1 || (RunPCIroms == 1 && isvga))
-        rom = map_pcirom(pci);
+        rom = map_pcirom(pci, phctx);
     if (! rom)
         // No ROM present.
         return;
     setRomSource(sources, rom, RS_PCIROM | (u32)pci);
-    init_optionrom(rom, pci->bdf, isvga);
+    init_optionrom(rom, pci->bdf, isvga, phctx);
 }
 
 
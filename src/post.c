@@ -155,6 +155,7 @@ platform_hardware_setup(void)
 
     // Initialize TPM
     tpm_setup();
+    qemu_cfg_measure_kernel();
 }
 
 void
@@ -8,7 +8,9 @@
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // struct romfile_s
+#include "std/optionrom.h" // struct rom_header
 #include "string.h" // memcmp
+#include "tcgbios.h" // tpm_hash_update
 
 static struct romfile_s *RomfileRoot VARVERIFY32INIT;
 
@@ -99,6 +101,34 @@ romfile_loadint(const char *name, u64 defval)
     return val;
 }
 
+// Add a chunk at offset 'pos' of a romfile that is being copied to the
+// 'hctx' measurement. If the file starts with an option rom header,
+// only the rom image it describes is measured (combined legacy and EFI
+// roms carry further images after it).
+void
+romfile_hash_chunk(struct tpm_hash_ctx *hctx, void *chunk, u32 pos, u32 len)
+{
+    struct rom_header *rom = chunk;
+    if (!pos && len >= sizeof(*rom) && rom->signature == OPTION_ROM_SIGNATURE)
+        hctx->limit = rom->size * 512;
+    tpm_hash_update(hctx, chunk, len);
+}
+
+// Copy a romfile and add its content to the 'hctx' measurement. Files
+// that can be read in pieces are hashed a chunk at a time as the chunks
+// arrive; others are hashed right after the copy.
+int
+romfile_copy_hashed(struct romfile_s *file, void *dest, u32 maxlen
+                    , struct tpm_hash_ctx *hctx)
+{
+    if (file->copy_hashed)
+        return file->copy_hashed(file, dest, maxlen, hctx);
+    int ret = file->copy(file, dest, maxlen);
+    if (ret > 0)
+        romfile_hash_chunk(hctx, dest, 0, ret);
+    return ret;
+}
+
 struct const_romfile_s {
     struct romfile_s file;
     void *data;
@@ -4,17 +4,24 @@
 #include "types.h" // u32
 
 // romfile.c
+struct tpm_hash_ctx;
 struct romfile_s {
     struct romfile_s *next;
     char name[128];
     u32 size;
     int (*copy)(struct romfile_s *file, void *dest, u32 maxlen);
+    int (*copy_hashed)(struct romfile_s *file, void *dest, u32 maxlen
+                       , struct tpm_hash_ctx *hctx);
 };
 void romfile_add(struct romfile_s *file);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
 void *romfile_loadfile(const char *name, int *psize);
 u64 romfile_loadint(const char *name, u64 defval);
+void romfile_hash_chunk(struct tpm_hash_ctx *hctx, void *chunk, u32 pos
+                        , u32 len);
+int romfile_copy_hashed(struct romfile_s *file, void *dest, u32 maxlen
+                        , struct tpm_hash_ctx *hctx);
 
 void const_romfile_add_int(char *name, u32 value);
 
@@ -0,0 +1,54 @@
+#ifndef __SHA_H
+#define __SHA_H
+
+#include "types.h" // u32
+
+struct sha1_ctx {
+    u32 h[5];
+};
+
+struct sha256_ctx {
+    u32 h[8];
+};
+
+struct sha512_ctx {
+    u64 h[8];
+};
+
+// sha1.c
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_blocks(struct sha1_ctx *ctx, const u8 *data, u32 length);
+void sha1_final(struct sha1_ctx *ctx, const u8 *data, u32 length, u32 total
+                , u8 *hash);
+u32 sha1(const u8 *data, u32 length, u8 *hash);
+
+// sha256.c
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_blocks(struct sha256_ctx *ctx, const u8 *data, u32 length);
+void sha256_final(struct sha256_ctx *ctx, const u8 *data, u32 length
+                  , u32 total, u8 *hash);
+u32 sha256(const u8 *data, u32 length, u8 *hash);
+
+// sha512.c
+void sha384_init(struct sha512_ctx *ctx);
+void sha512_init(struct sha512_ctx *ctx);
+void sha512_blocks(struct sha512_ctx *ctx, const u8 *data, u32 length);
+void sha384_final(struct sha512_ctx *ctx, const u8 *data, u32 length
+                  , u32 total, u8 *hash);
+void sha512_final(struct sha512_ctx *ctx, const u8 *data, u32 length
+                  , u32 total, u8 *hash);
+u32 sha384(const u8 *data, u32 length, u8 *hash);
+u32 sha512(const u8 *data, u32 length, u8 *hash);
+
+// sha_ni.c
+struct sha_ni_state {
+    u32 cr0, cr4;
+    u8 xmm[8 * 16];
+};
+int sha_ni_begin(struct sha_ni_state *st);
+void sha_ni_end(struct sha_ni_state *st);
+int sha1_blocks_ni(struct sha1_ctx *ctx, const u8 *data, u32 length);
+int sha256_blocks_ni(struct sha256_ctx *ctx, const u8 *data, u32 length);
+void sha_setup(void);
+
+#endif // sha.h
@@ -13,17 +13,12 @@
 
 #include "config.h"
 #include "byteorder.h" // cpu_to_*, __swab64
-#include "sha1.h" // sha1
+#include "sha.h" // sha1
 #include "string.h" // memcpy
 #include "x86.h" // rol
 
-typedef struct _sha1_ctx {
-    u32 h[5];
-} sha1_ctx;
-
-
 static void
-sha1_block(u32 *w, sha1_ctx *ctx)
+sha1_block(u32 *w, struct sha1_ctx *ctx)
 {
     u32 i;
     u32 a,b,c,d,e,f;
@@ -83,27 +78,49 @@ sha1_block(u32 *w, sha1_ctx *ctx)
 }
 
 
-static void
-sha1_do(sha1_ctx *ctx, const u8 *data32, u32 length)
+void
+sha1_init(struct sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+}
+
+// Hash the complete 64 byte blocks at 'data'
+void
+sha1_blocks(struct sha1_ctx *ctx, const u8 *data, u32 length)
 {
     u32 offset;
-    u16 num;
-    u32 bits = 0;
     u32 w[80];
-    u64 tmp;
 
-    /* treat data in 64-byte chunks */
+    if (!sha1_blocks_ni(ctx, data, length))
+        return;
+
     for (offset = 0; length - offset >= 64; offset += 64) {
-        memcpy(w, data32 + offset, 64);
-        sha1_block((u32 *)w, ctx);
-        bits += (64 * 8);
+        memcpy(w, data + offset, 64);
+        sha1_block(w, ctx);
     }
+}
+
+// Hash the last 'length' bytes of the data and store the digest of
+// all 'total' bytes in 'hash' (which may point to 'ctx')
+void
+sha1_final(struct sha1_ctx *ctx, const u8 *data, u32 length, u32 total
+           , u8 *hash)
+{
+    u32 offset = length & ~63;
+    u16 num;
+    u32 w[80];
+    u64 tmp;
+
+    sha1_blocks(ctx, data, offset);
 
     /* last block with less than 64 bytes */
     num = length - offset;
-    bits += (num << 3);
 
-    memcpy(w, data32 + offset, num);
+    memcpy(w, data + offset, num);
     ((u8 *)w)[num] = 0x80;
     if (64 - (num + 1) > 0)
         memset( &((u8 *)w)[num + 1], 0x0, 64 - (num + 1));
@@ -115,14 +132,14 @@ sha1_do(sha1_ctx *ctx, const u8 *data32, u32 length)
     }
 
     /* write number of bits to end of block */
-    tmp = __swab64(bits);
+    tmp = __swab64((u64)total << 3);
     memcpy(&w[14], &tmp, 8);
 
     sha1_block(w, ctx);
 
     /* need to switch result's endianness */
     for (num = 0; num < 5; num++)
-        ctx->h[num] = cpu_to_be32(ctx->h[num]);
+        ((u32 *)hash)[num] = cpu_to_be32(ctx->h[num]);
 }
 
 
@@ -132,16 +149,13 @@ sha1(const u8 *data, u32 length, u8 *hash)
     if (!CONFIG_TCGBIOS)
         return 0;
 
-    sha1_ctx ctx = {
-        .h[0] = 0x67452301,
-        .h[1] = 0xefcdab89,
-        .h[2] = 0x98badcfe,
-        .h[3] = 0x10325476,
-        .h[4] = 0xc3d2e1f0,
-    };
-
-    sha1_do(&ctx, data, length);
-    memcpy(hash, &ctx.h[0], 20);
+    struct sha1_ctx ctx;
+    struct sha_ni_state st;
+    int ni = sha_ni_begin(&st);
+    sha1_init(&ctx);
+    sha1_final(&ctx, data, length, length, hash);
+    if (!ni)
+        sha_ni_end(&st);
 
     return 0;
 }
@@ -0,0 +1,170 @@
+//  Support for Calculation of SHA256 in SW
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+//  See: http://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+//
+
+#include "config.h"
+#include "byteorder.h" // cpu_to_*, __swab64
+#include "sha.h" // sha256
+#include "string.h" // memcpy
+
+static inline u32 ror32(u32 val, int n) {
+    return (val >> n) | (val << (32 - n));
+}
+
+static const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+sha256_block(u32 *w, struct sha256_ctx *ctx)
+{
+    u32 i;
+    u32 a, b, c, d, e, f, g, h;
+    u32 t1, t2;
+
+    /* change endianness of given data */
+    for (i = 0; i < 16; i++)
+        w[i] = be32_to_cpu(w[i]);
+
+    a = ctx->h[0];
+    b = ctx->h[1];
+    c = ctx->h[2];
+    d = ctx->h[3];
+    e = ctx->h[4];
+    f = ctx->h[5];
+    g = ctx->h[6];
+    h = ctx->h[7];
+
+    /* the message schedule is kept in a rolling 16 word window */
+    for (i = 0; i < 64; i++) {
+        if (i >= 16) {
+            u32 w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+            w[i & 15] += (ror32(w15, 7) ^ ror32(w15, 18) ^ (w15 >> 3))
+                         + w[(i - 7) & 15]
+                         + (ror32(w2, 17) ^ ror32(w2, 19) ^ (w2 >> 10));
+        }
+        t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25))
+             + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i & 15];
+        t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22))
+             + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->h[5] += f;
+    ctx->h[6] += g;
+    ctx->h[7] += h;
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+    ctx->h[0] = 0x6a09e667;
+    ctx->h[1] = 0xbb67ae85;
+    ctx->h[2] = 0x3c6ef372;
+    ctx->h[3] = 0xa54ff53a;
+    ctx->h[4] = 0x510e527f;
+    ctx->h[5] = 0x9b05688c;
+    ctx->h[6] = 0x1f83d9ab;
+    ctx->h[7] = 0x5be0cd19;
+}
+
+// Hash the complete 64 byte blocks at 'data'
+void
+sha256_blocks(struct sha256_ctx *ctx, const u8 *data, u32 length)
+{
+    u32 offset;
+    u32 w[16];
+
+    if (!sha256_blocks_ni(ctx, data, length))
+        return;
+
+    for (offset = 0; length - offset >= 64; offset += 64) {
+        memcpy(w, data + offset, 64);
+        sha256_block(w, ctx);
+    }
+}
+
+// Hash the last 'length' bytes of the data and store the digest of
+// all 'total' bytes in 'hash' (which may point to 'ctx')
+void
+sha256_final(struct sha256_ctx *ctx, const u8 *data, u32 length, u32 total
+             , u8 *hash)
+{
+    u32 offset = length & ~63;
+    u16 num;
+    u32 w[16];
+    u64 tmp;
+
+    sha256_blocks(ctx, data, offset);
+
+    /* last block with less than 64 bytes */
+    num = length - offset;
+
+    memcpy(w, data + offset, num);
+    ((u8 *)w)[num] = 0x80;
+    if (64 - (num + 1) > 0)
+        memset(&((u8 *)w)[num + 1], 0x0, 64 - (num + 1));
+
+    if (num >= 56) {
+        /* cannot append number of bits here */
+        sha256_block(w, ctx);
+        memset(w, 0x0, 60);
+    }
+
+    /* write number of bits to end of block */
+    tmp = __swab64((u64)total << 3);
+    memcpy(&w[14], &tmp, 8);
+
+    sha256_block(w, ctx);
+
+    /* need to switch result's endianness */
+    for (num = 0; num < 8; num++)
+        ((u32 *)hash)[num] = cpu_to_be32(ctx->h[num]);
+}
+
+u32
+sha256(const u8 *data, u32 length, u8 *hash)
+{
+    if (!CONFIG_TCGBIOS)
+        return 0;
+
+    struct sha256_ctx ctx;
+    struct sha_ni_state st;
+    int ni = sha_ni_begin(&st);
+    sha256_init(&ctx);
+    sha256_final(&ctx, data, length, length, hash);
+    if (!ni)
+        sha_ni_end(&st);
+
+    return 0;
+}
@@ -0,0 +1,245 @@
+//  Support for Calculation of SHA1 and SHA256 with the x86 SHA extensions
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+//
+//  See: Intel(R) SHA Extensions: New Instructions Supporting the Secure
+//       Hash Algorithm on Intel(R) Architecture Processors
+//
+
+#include "biosvar.h" // VARLOW
+#include "config.h" // CONFIG_TCGBIOS
+#include "output.h" // dprintf
+#include "sha.h" // sha1_blocks_ni
+#include "x86.h" // cpuid, cr0_read
+
+typedef char v16qi __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+
+// Only the block functions below are compiled with SSE enabled; the
+// rest of the firmware must not use the xmm registers.
+#define SHA_NI_TARGET __attribute__((target("sse2,ssse3,sse4.1,sha")))
+
+static int ShaNiEnabled;
+// Set between sha_ni_begin() and sha_ni_end()
+u8 ShaNiActive VARLOW;
+
+static inline SHA_NI_TARGET v4si
+load_be128(const u8 *data, v16qi mask)
+{
+    v16qi v = __builtin_ia32_loaddqu((const char *)data);
+    return (v4si)__builtin_ia32_pshufb128(v, mask);
+}
+
+static void noinline SHA_NI_TARGET
+sha1_blocks_ni_sse(struct sha1_ctx *ctx, const u8 *data, u32 length)
+{
+    const v16qi mask = { 15, 14, 13, 12, 11, 10, 9, 8,
+                         7, 6, 5, 4, 3, 2, 1, 0 };
+    v4si abcd = (v4si)__builtin_ia32_loaddqu((const char *)ctx->h);
+    v4si e0 = { 0, 0, 0, ctx->h[4] };
+    v4si msg[4], prev = abcd, ev;
+    u32 offset;
+    int i;
+
+    abcd = __builtin_ia32_pshufd(abcd, 0x1b);
+
+    for (offset = 0; length - offset >= 64; offset += 64) {
+        v4si abcd_save = abcd, e_save = e0;
+
+        // 20 groups of 4 rounds; each group consumes 4 message words
+        for (i = 0; i < 20; i++) {
+            v4si m;
+            if (i < 4)
+                m = load_be128(data + offset + i * 16, mask);
+            else
+                m = __builtin_ia32_sha1msg2(
+                    __builtin_ia32_sha1msg1(msg[i & 3], msg[(i + 1) & 3])
+                    ^ msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            msg[i & 3] = m;
+
+            if (i)
+                ev = __builtin_ia32_sha1nexte(prev, m);
+            else
+                ev = e0 + m;
+            prev = abcd;
+            switch (i / 5) {
+            case 0: abcd = __builtin_ia32_sha1rnds4(abcd, ev, 0); break;
+            case 1: abcd = __builtin_ia32_sha1rnds4(abcd, ev, 1); break;
+            case 2: abcd = __builtin_ia32_sha1rnds4(abcd, ev, 2); break;
+            default: abcd = __builtin_ia32_sha1rnds4(abcd, ev, 3); break;
+            }
+        }
+
+        e0 = __builtin_ia32_sha1nexte(prev, e_save);
+        abcd += abcd_save;
+    }
+
+    abcd = __builtin_ia32_pshufd(abcd, 0x1b);
+    __builtin_ia32_storedqu((char *)ctx->h, (v16qi)abcd);
+    ctx->h[4] = e0[3];
+}
+
+static const u32 sha256_k_ni[64] __aligned(16) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void noinline SHA_NI_TARGET
+sha256_blocks_ni_sse(struct sha256_ctx *ctx, const u8 *data, u32 length)
+{
+    const v16qi mask = { 3, 2, 1, 0, 7, 6, 5, 4,
+                         11, 10, 9, 8, 15, 14, 13, 12 };
+    v4si tmp = (v4si)__builtin_ia32_loaddqu((const char *)&ctx->h[0]);
+    v4si state1 = (v4si)__builtin_ia32_loaddqu((const char *)&ctx->h[4]);
+    v4si state0, msg[4];
+    u32 offset;
+    int i;
+
+    // Rearrange the state into the ABEF / CDGH form used by SHA256RNDS2
+    tmp = __builtin_ia32_pshufd(tmp, 0xb1);
+    state1 = __builtin_ia32_pshufd(state1, 0x1b);
+    state0 = (v4si)__builtin_ia32_palignr128((v2di)tmp, (v2di)state1, 64);
+    state1 = (v4si)__builtin_ia32_pblendw128((v8hi)state1, (v8hi)tmp, 0xf0);
+
+    for (offset = 0; length - offset >= 64; offset += 64) {
+        v4si save0 = state0, save1 = state1;
+
+        // 16 groups of 4 rounds; each group consumes 4 message words
+        for (i = 0; i < 16; i++) {
+            v4si m;
+            if (i < 4)
+                m = load_be128(data + offset + i * 16, mask);
+            else
+                m = __builtin_ia32_sha256msg2(
+                    __builtin_ia32_sha256msg1(msg[i & 3], msg[(i + 1) & 3])
+                    + (v4si)__builtin_ia32_palignr128(
+                        (v2di)msg[(i + 3) & 3], (v2di)msg[(i + 2) & 3], 32)
+                    , msg[(i + 3) & 3]);
+            msg[i & 3] = m;
+
+            v4si k = *(const v4si *)&sha256_k_ni[i * 4];
+            v4si wk = m + k;
+            state1 = __builtin_ia32_sha256rnds2(state1, state0, wk);
+            wk = __builtin_ia32_pshufd(wk, 0x0e);
+            state0 = __builtin_ia32_sha256rnds2(state0, state1, wk);
+        }
+
+        state0 += save0;
+        state1 += save1;
+    }
+
+    // Return to the natural A..H order
+    tmp = __builtin_ia32_pshufd(state0, 0x1b);
+    state1 = __builtin_ia32_pshufd(state1, 0xb1);
+    state0 = (v4si)__builtin_ia32_pblendw128((v8hi)tmp, (v8hi)state1, 0xf0);
+    state1 = (v4si)__builtin_ia32_palignr128((v2di)state1, (v2di)tmp, 64);
+    __builtin_ia32_storedqu((char *)&ctx->h[0], (v16qi)state0);
+    __builtin_ia32_storedqu((char *)&ctx->h[4], (v16qi)state1);
+}
+
+// The caller of the firmware (eg, an INT 1Ah user) may have live data
+// in the xmm registers, so preserve them around the accelerated code.
+#define SAVE_XMM(buf)                                                   \
+    asm volatile("movdqu %%xmm0, 0(%0)\n  movdqu %%xmm1, 16(%0)\n"      \
+                 "movdqu %%xmm2, 32(%0)\n  movdqu %%xmm3, 48(%0)\n"     \
+                 "movdqu %%xmm4, 64(%0)\n  movdqu %%xmm5, 80(%0)\n"     \
+                 "movdqu %%xmm6, 96(%0)\n  movdqu %%xmm7, 112(%0)\n"    \
+                 : : "r"(buf) : "memory")
+#define RESTORE_XMM(buf)                                                \
+    asm volatile("movdqu 0(%0), %%xmm0\n  movdqu 16(%0), %%xmm1\n"      \
+                 "movdqu 32(%0), %%xmm2\n  movdqu 48(%0), %%xmm3\n"     \
+                 "movdqu 64(%0), %%xmm4\n  movdqu 80(%0), %%xmm5\n"     \
+                 "movdqu 96(%0), %%xmm6\n  movdqu 112(%0), %%xmm7\n"    \
+                 : : "r"(buf) : "memory")
+
+// Prepare the cpu for the accelerated block functions, which are used
+// until sha_ni_end(). The control registers are set up for SSE and the
+// xmm registers are saved; both are restored by sha_ni_end(), so that
+// the state the firmware was called with (or hands to the OS) is left
+// untouched. Returns non-zero if the block functions can't be used (or
+// are already set up by an outer caller); sha_ni_end() must then not
+// be called.
+int
+sha_ni_begin(struct sha_ni_state *st)
+{
+    if (!CONFIG_TCGBIOS || !ShaNiEnabled || GET_LOW(ShaNiActive))
+        return -1;
+    st->cr0 = cr0_read();
+    st->cr4 = cr4_read();
+    if (st->cr0 & (CR0_EM | CR0_TS))
+        cr0_write((st->cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP);
+    if (!(st->cr4 & CR4_OSFXSR))
+        cr4_write(st->cr4 | CR4_OSFXSR);
+    SAVE_XMM(st->xmm);
+    SET_LOW(ShaNiActive, 1);
+    return 0;
+}
+
+void
+sha_ni_end(struct sha_ni_state *st)
+{
+    SET_LOW(ShaNiActive, 0);
+    RESTORE_XMM(st->xmm);
+    if (st->cr4 != cr4_read())
+        cr4_write(st->cr4);
+    if (st->cr0 != cr0_read())
+        cr0_write(st->cr0);
+}
+
+int
+sha1_blocks_ni(struct sha1_ctx *ctx, const u8 *data, u32 length)
+{
+    if (!CONFIG_TCGBIOS || !GET_LOW(ShaNiActive))
+        return -1;
+    sha1_blocks_ni_sse(ctx, data, length);
+    return 0;
+}
+
+int
+sha256_blocks_ni(struct sha256_ctx *ctx, const u8 *data, u32 length)
+{
+    if (!CONFIG_TCGBIOS || !GET_LOW(ShaNiActive))
+        return -1;
+    sha256_blocks_ni_sse(ctx, data, length);
+    return 0;
+}
+
+// Enable the accelerated block functions if the cpu supports them
+void
+sha_setup(void)
+{
+    if (!CONFIG_TCGBIOS)
+        return;
+
+    u32 eax, ebx, ecx, edx, cpuid_features = 0;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7)
+        return;
+    cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
+    u32 need_ecx = CPUID_ECX_SSSE3 | CPUID_ECX_SSE41;
+    u32 need_edx = CPUID_FXSR | CPUID_SSE2;
+    if ((ecx & need_ecx) != need_ecx || (cpuid_features & need_edx) != need_edx)
+        return;
+    cpuid(7, &eax, &ebx, &ecx, &edx);
+    if (!(ebx & CPUID_7_EBX_SHA))
+        return;
+
+    ShaNiEnabled = 1;
+    dprintf(3, "Using SHA extensions for sha1 and sha256\n");
+}
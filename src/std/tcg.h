@@ -76,7 +76,7 @@ enum irq_ids {
 struct hleei_short
 {
     u16   ipblength;
-    u16   reserved;
+    u16   hashalg;   /* reserved; SeaBIOS: TPM2_ALG_* of hleeo digest */
     const void *hashdataptr;
     u32   hashdatalen;
     u32   pcrindex;
@@ -87,7 +87,7 @@ struct hleei_short
 struct hleei_long
 {
     u16   ipblength;
-    u16   reserved;
+    u16   hashalg;   /* reserved; SeaBIOS: TPM2_ALG_* of hleeo digest */
     void *hashdataptr;
     u32   hashdatalen;
     u32   pcrindex;
@@ -96,6 +96,8 @@ struct hleei_long
     u32   logdatalen;
 } PACKED;
 
+/* for hleei.hashalg other than 0 and TPM2_ALG_SHA1 the digest of that
+ * algorithm is returned, which may be larger than SHA1_BUFSIZE */
 struct hleeo
 {
     u16    opblength;
@@ -350,10 +352,12 @@ struct tpm_res_sha1complete {
 #define TPM2_CC_StirRandom          0x146
 #define TPM2_CC_GetCapability       0x17a
 #define TPM2_CC_GetRandom           0x17b
+#define TPM2_CC_GetTestResult       0x17c
 #define TPM2_CC_PCR_Extend          0x182
 
 /* TPM 2 error codes */
 #define TPM2_RC_INITIALIZE          0x100
+#define TPM2_RC_TESTING             0x90a
 
 /* TPM 2 Capabilities */
 #define TPM2_CAP_PCRS               0x00000005
@@ -376,9 +380,14 @@ struct tpm2b_20 {
     u8 buffer[20];
 } PACKED;
 
+struct tpm2b_64 {
+    u16 size;
+    u8 buffer[64];
+} PACKED;
+
 struct tpm2_res_getrandom {
     struct tpm_rsp_header hdr;
-    struct tpm2b_20 rnd;
+    struct tpm2b_64 rnd;
 } PACKED;
 
 struct tpm2_authblock {
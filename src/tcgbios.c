@@ -16,7 +16,8 @@
 #include "fw/paravirt.h" // runningOnXen
 #include "hw/tpm_drivers.h" // tpm_drivers[]
 #include "output.h" // dprintf
-#include "sha1.h" // sha1
+#include "romfile.h" // romfile_loadint
+#include "sha.h" // sha1
 #include "std/acpi.h"  // RSDP_SIGNATURE, rsdt_descriptor
 #include "std/smbios.h" // struct smbios_entry_point
 #include "std/tcg.h" // TCG_PC_LOGOVERFLOW
@@ -25,6 +26,7 @@
 #include "util.h" // printf, get_keystroke
 #include "stacks.h" // wait_threads, reset
 #include "malloc.h" // malloc_high
+#include "x86.h" // cpuid
 
 
 /****************************************************************
@@ -46,9 +48,22 @@ struct {
 
     /* address of last entry written (need for TCG_StatusCheck) */
     u8 *          log_area_last_entry;
+
+    /* size the log would have needed without dropping entries */
+    u32           log_area_high_water;
+
+    /* number of entries dropped since the log was full */
+    u32           entries_dropped;
+
+    /* TCPA or TPM2 ACPI table announcing the log area */
+    struct acpi_table_header *log_area_table;
+
+    /* the log area was allocated by tpm_log_grow() */
+    u8            log_area_allocated;
 } tpm_state VARLOW;
 
-static int tpm_set_log_area(u8 *log_area_start_address,
+static int tpm_set_log_area(struct acpi_table_header *table,
+                            u8 *log_area_start_address,
                             u32 log_area_minimum_length)
 {
     if (!log_area_start_address || !log_area_minimum_length)
@@ -59,7 +74,11 @@ static int tpm_set_log_area(u8 *log_area_start_address,
     tpm_state.log_area_minimum_length = log_area_minimum_length;
     tpm_state.log_area_next_entry = log_area_start_address;
     tpm_state.log_area_last_entry = NULL;
+    tpm_state.log_area_high_water = 0;
     tpm_state.entry_count = 0;
+    tpm_state.entries_dropped = 0;
+    tpm_state.log_area_table = table;
+    tpm_state.log_area_allocated = 0;
     return 0;
 }
 
@@ -74,7 +93,8 @@ tpm_tcpa_probe(void)
             (u8 *)(long)tcpa->log_area_start_address,
             tcpa->log_area_minimum_length);
 
-    return tpm_set_log_area((u8*)(long)tcpa->log_area_start_address,
+    return tpm_set_log_area((void*)tcpa,
+                            (u8*)(long)tcpa->log_area_start_address,
                             tcpa->log_area_minimum_length);
 }
 
@@ -92,10 +112,59 @@ tpm_tpm2_probe(void)
             (u8 *)(long)tpm2->log_area_start_address,
             tpm2->log_area_minimum_length);
 
-    return tpm_set_log_area((u8*)(long)tpm2->log_area_start_address,
+    return tpm_set_log_area((void*)tpm2,
+                            (u8*)(long)tpm2->log_area_start_address,
                             tpm2->log_area_minimum_length);
 }
 
+/*
+ * Move the log into a larger area that holds at least 'logsize' bytes
+ * and announce the new area in the ACPI table. Only used during POST,
+ * before the OS reads the ACPI tables.
+ */
+int VISIBLE32INIT
+tpm_log_grow(u32 logsize)
+{
+    u32 len = tpm_state.log_area_minimum_length;
+    u32 newlen = len * 2;
+    while (newlen < logsize)
+        newlen *= 2;
+    u8 *newlog = malloc_high(newlen);
+    if (!newlog) {
+        warn_noalloc();
+        return -1;
+    }
+
+    u8 *log = tpm_state.log_area_start_address;
+    u32 used = tpm_state.log_area_next_entry - log;
+    memcpy(newlog, log, used);
+    memset(newlog + used, 0, newlen - used);
+    if (tpm_state.log_area_last_entry)
+        tpm_state.log_area_last_entry += newlog - log;
+    tpm_state.log_area_next_entry = newlog + used;
+    tpm_state.log_area_start_address = newlog;
+    tpm_state.log_area_minimum_length = newlen;
+    if (tpm_state.log_area_allocated)
+        free(log);
+    tpm_state.log_area_allocated = 1;
+
+    struct acpi_table_header *table = tpm_state.log_area_table;
+    if (table->signature == TCPA_SIGNATURE) {
+        struct tcpa_descriptor_rev2 *tcpa = (void*)table;
+        tcpa->log_area_minimum_length = newlen;
+        tcpa->log_area_start_address = (u32)newlog;
+    } else {
+        struct tpm2_descriptor_rev2 *tpm2 = (void*)table;
+        tpm2->log_area_minimum_length = newlen;
+        tpm2->log_area_start_address = (u32)newlog;
+    }
+    table->checksum -= checksum(table, table->length);
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Moved log to %p, LAML = %u\n",
+            newlog, newlen);
+    return 0;
+}
+
 /*
  * Extend the ACPI log with the given entry by copying the
  * entry data into the log.
@@ -122,8 +191,11 @@ tpm_log_event(struct tpm_log_header *entry, int digest_len
                 + sizeof(struct tpm_log_trailer) + event_len);
     u32 logsize = (tpm_state.log_area_next_entry + size
                    - tpm_state.log_area_start_address);
-    if (logsize > tpm_state.log_area_minimum_length) {
+    tpm_state.log_area_high_water += size;
+    if (logsize > tpm_state.log_area_minimum_length
+        && (!in_post() || tpm_log_grow(logsize))) {
         dprintf(DEBUG_tcg, "TCGBIOS: LOG OVERFLOW: size = %d\n", size);
+        tpm_state.entries_dropped++;
         return -1;
     }
 
@@ -140,6 +212,35 @@ tpm_log_event(struct tpm_log_header *entry, int digest_len
     return 0;
 }
 
+// A position in the log that later entries can be removed back to
+struct tpm_log_mark {
+    u32 next, last, count;
+};
+
+static void
+tpm_log_mark(struct tpm_log_mark *mark)
+{
+    u8 *log = tpm_state.log_area_start_address;
+    mark->next = tpm_state.log_area_next_entry - log;
+    mark->last = (tpm_state.log_area_last_entry
+                  ? tpm_state.log_area_last_entry - log : -1);
+    mark->count = tpm_state.entry_count;
+}
+
+// Remove all entries written since 'mark' was taken
+static void
+tpm_log_rewind(struct tpm_log_mark *mark)
+{
+    u8 *log = tpm_state.log_area_start_address;
+    if (!tpm_state.log_area_next_entry)
+        return;
+    u8 *next = log + mark->next;
+    memset(next, 0, tpm_state.log_area_next_entry - next);
+    tpm_state.log_area_next_entry = next;
+    tpm_state.log_area_last_entry = mark->last == -1 ? NULL : log + mark->last;
+    tpm_state.entry_count = mark->count;
+}
+
 
 /****************************************************************
  * Digest formatting
@@ -161,23 +262,45 @@ struct tpm_log_entry {
            + SHA512_BUFSIZE + SM3_256_BUFSIZE];
 } PACKED;
 
+static const struct hash_parameters {
+    u16 hashalg;
+    u8  hash_buffersize;
+} hash_parameters[] = {
+    {
+        .hashalg = TPM2_ALG_SHA1,
+        .hash_buffersize = SHA1_BUFSIZE,
+    }, {
+        .hashalg = TPM2_ALG_SHA256,
+        .hash_buffersize = SHA256_BUFSIZE,
+    }, {
+        .hashalg = TPM2_ALG_SHA384,
+        .hash_buffersize = SHA384_BUFSIZE,
+    }, {
+        .hashalg = TPM2_ALG_SHA512,
+        .hash_buffersize = SHA512_BUFSIZE,
+    }, {
+        .hashalg = TPM2_ALG_SM3_256,
+        .hash_buffersize = SM3_256_BUFSIZE,
+    }
+};
+
+static const struct hash_parameters *
+tpm20_find_by_hashalg(u16 hashAlg)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(hash_parameters); i++)
+        if (hash_parameters[i].hashalg == hashAlg)
+            return &hash_parameters[i];
+    return NULL;
+}
+
 static int
 tpm20_get_hash_buffersize(u16 hashAlg)
 {
-    switch (hashAlg) {
-    case TPM2_ALG_SHA1:
-        return SHA1_BUFSIZE;
-    case TPM2_ALG_SHA256:
-        return SHA256_BUFSIZE;
-    case TPM2_ALG_SHA384:
-        return SHA384_BUFSIZE;
-    case TPM2_ALG_SHA512:
-        return SHA512_BUFSIZE;
-    case TPM2_ALG_SM3_256:
-        return SM3_256_BUFSIZE;
-    default:
+    const struct hash_parameters *hp = tpm20_find_by_hashalg(hashAlg);
+    if (!hp)
         return -1;
-    }
+    return hp->hash_buffersize;
 }
 
 // Add an entry at the start of the log describing digest formats
@@ -248,23 +371,294 @@ tpm20_write_EfiSpecIdEventStruct(void)
     return tpm_log_event(&le.hdr, SHA1_BUFSIZE, &event, event_size);
 }
 
+
+/****************************************************************
+ * Multi-bank hashing
+ ****************************************************************/
+
+static struct tpm_hash_bank *
+tpm_hash_find_bank(struct tpm_hash_ctx *hctx, u16 hashalg)
+{
+    int i;
+    for (i = 0; i < hctx->count; i++)
+        if (hctx->banks[i].hashalg == hashalg)
+            return &hctx->banks[i];
+    return NULL;
+}
+
+static void
+tpm_hash_add_bank(struct tpm_hash_ctx *hctx, u16 hashalg)
+{
+    if (tpm_hash_find_bank(hctx, hashalg)
+        || hctx->count >= ARRAY_SIZE(hctx->banks))
+        return;
+    struct tpm_hash_bank *b = &hctx->banks[hctx->count];
+    switch (hashalg) {
+    case TPM2_ALG_SHA1:
+        sha1_init(&b->sha1);
+        break;
+    case TPM2_ALG_SHA256:
+        sha256_init(&b->sha256);
+        break;
+    case TPM2_ALG_SHA384:
+        sha384_init(&b->sha512);
+        break;
+    case TPM2_ALG_SHA512:
+        sha512_init(&b->sha512);
+        break;
+    default:
+        // No implementation of this hash algorithm
+        return;
+    }
+    b->hashalg = hashalg;
+    hctx->count++;
+}
+
+static void
+tpm_hash_reset(struct tpm_hash_ctx *hctx)
+{
+    hctx->count = 0;
+    hctx->total = 0;
+    hctx->limit = ~0;
+}
+
+// Prepare to hash data for all active PCR banks of the TPM
+void
+tpm_hash_init(struct tpm_hash_ctx *hctx)
+{
+    tpm_hash_reset(hctx);
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA1);
+
+    if (TPM_version != TPM_VERSION_2 || !tpm20_pcr_selection)
+        return;
+
+    struct tpms_pcr_selection *sel = tpm20_pcr_selection->selections;
+    void *nsel, *end = (void*)tpm20_pcr_selection + tpm20_pcr_selection_size;
+
+    u32 count;
+    for (count = 0; count < be32_to_cpu(tpm20_pcr_selection->count); count++) {
+        nsel = (void*)sel + sizeof(*sel) + sel->sizeOfSelect;
+        if (nsel > end)
+            break;
+        tpm_hash_add_bank(hctx, be16_to_cpu(sel->hashAlg));
+        sel = nsel;
+    }
+}
+
+static void
+tpm_hash_blocks(struct tpm_hash_bank *b, const u8 *data, u32 length)
+{
+    switch (b->hashalg) {
+    case TPM2_ALG_SHA1:
+        sha1_blocks(&b->sha1, data, length);
+        break;
+    case TPM2_ALG_SHA256:
+        sha256_blocks(&b->sha256, data, length);
+        break;
+    case TPM2_ALG_SHA384:
+    case TPM2_ALG_SHA512:
+        sha512_blocks(&b->sha512, data, length);
+        break;
+    }
+}
+
+static void
+tpm_hash_bank_final(struct tpm_hash_bank *b, const u8 *data, u32 length
+                    , u32 total)
+{
+    switch (b->hashalg) {
+    case TPM2_ALG_SHA1:
+        sha1_final(&b->sha1, data, length, total, b->hash);
+        break;
+    case TPM2_ALG_SHA256:
+        sha256_final(&b->sha256, data, length, total, b->hash);
+        break;
+    case TPM2_ALG_SHA384:
+        sha384_final(&b->sha512, data, length, total, b->hash);
+        break;
+    case TPM2_ALG_SHA512:
+        sha512_final(&b->sha512, data, length, total, b->hash);
+        break;
+    }
+}
+
+// Hash one stride of data with all algorithms while it is in the cache
+static void
+tpm_hash_stride(struct tpm_hash_ctx *hctx, const u8 *data)
+{
+    int i;
+    for (i = 0; i < hctx->count; i++)
+        tpm_hash_blocks(&hctx->banks[i], data, TPM_HASH_STRIDE);
+}
+
+// Add the next 'length' bytes of the data to the hashes
+void
+tpm_hash_update(struct tpm_hash_ctx *hctx, const void *data, u32 length)
+{
+    if (length > hctx->limit - hctx->total)
+        length = hctx->limit - hctx->total;
+    u32 pos = hctx->total % TPM_HASH_STRIDE;
+    hctx->total += length;
+
+    if (pos) {
+        // Complete the partial stride from a previous update
+        u32 fill = TPM_HASH_STRIDE - pos;
+        if (fill > length)
+            fill = length;
+        memcpy(&hctx->buf[pos], data, fill);
+        if (pos + fill < TPM_HASH_STRIDE)
+            return;
+        data += fill;
+        length -= fill;
+    }
+
+    // Set up the accelerated block functions once for the whole update
+    struct sha_ni_state st;
+    int ni = sha_ni_begin(&st);
+    if (pos)
+        tpm_hash_stride(hctx, hctx->buf);
+    for (; length >= TPM_HASH_STRIDE; length -= TPM_HASH_STRIDE) {
+        tpm_hash_stride(hctx, data);
+        data += TPM_HASH_STRIDE;
+    }
+    if (!ni)
+        sha_ni_end(&st);
+
+    memcpy(hctx->buf, data, length);
+}
+
+// Finish the hashes after all data has been added
+static void
+tpm_hash_final(struct tpm_hash_ctx *hctx)
+{
+    int i;
+    for (i = 0; i < hctx->count; i++)
+        tpm_hash_bank_final(&hctx->banks[i], hctx->buf
+                            , hctx->total % TPM_HASH_STRIDE, hctx->total);
+}
+
+// Use an already calculated sha1 hash as the only digest
+static void
+tpm_hash_set_sha1(struct tpm_hash_ctx *hctx, const u8 *digest)
+{
+    tpm_hash_reset(hctx);
+    hctx->count = 1;
+    hctx->banks[0].hashalg = TPM2_ALG_SHA1;
+    memcpy(hctx->banks[0].hash, digest, SHA1_BUFSIZE);
+}
+
+// The digests of some data with all implemented hash algorithms
+struct tpm_digests {
+    u8 sha1[SHA1_BUFSIZE];
+    u8 sha256[SHA256_BUFSIZE];
+    u8 sha384[SHA384_BUFSIZE];
+    u8 sha512[SHA512_BUFSIZE];
+};
+
+// Offset of the digest of a hash algorithm in struct tpm_digests
+static int
+tpm_digests_offset(u16 hashalg)
+{
+    switch (hashalg) {
+    case TPM2_ALG_SHA1:
+        return offsetof(struct tpm_digests, sha1);
+    case TPM2_ALG_SHA256:
+        return offsetof(struct tpm_digests, sha256);
+    case TPM2_ALG_SHA384:
+        return offsetof(struct tpm_digests, sha384);
+    default:
+        return offsetof(struct tpm_digests, sha512);
+    }
+}
+
+// Prepare to hash data with all implemented hash algorithms, for data
+// that is hashed before the PCR banks of the TPM are known
+static void
+tpm_hash_init_all(struct tpm_hash_ctx *hctx)
+{
+    tpm_hash_reset(hctx);
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA1);
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA256);
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA384);
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA512);
+}
+
+// Store the final digests of a tpm_hash_init_all() context
+static void
+tpm_hash_save_all(struct tpm_hash_ctx *hctx, struct tpm_digests *d)
+{
+    int i;
+    for (i = 0; i < hctx->count; i++) {
+        struct tpm_hash_bank *b = &hctx->banks[i];
+        memcpy((void*)d + tpm_digests_offset(b->hashalg), b->hash
+               , tpm20_find_by_hashalg(b->hashalg)->hash_buffersize);
+    }
+}
+
+// Use previously calculated digests for all active PCR banks
+static void
+tpm_hash_set_all(struct tpm_hash_ctx *hctx, const struct tpm_digests *d)
+{
+    tpm_hash_init(hctx);
+    int i;
+    for (i = 0; i < hctx->count; i++) {
+        struct tpm_hash_bank *b = &hctx->banks[i];
+        memcpy(b->hash, (void*)d + tpm_digests_offset(b->hashalg)
+               , tpm20_find_by_hashalg(b->hashalg)->hash_buffersize);
+    }
+}
+
+// Event data that is measured with the same contents on every boot and
+// its digests, which are calculated at build time
+struct tpm_const_digest {
+    const char *data;
+    u32 length;
+    struct tpm_digests digests;
+};
+
+#include "tpmdigests.h" // tpm_const_digests
+
+// Use the precalculated digests if 'data' is constant event data;
+// returns non-zero if the data needs to be hashed.
+static int
+tpm_hash_set_const(struct tpm_hash_ctx *hctx, const u8 *data, u32 length)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(tpm_const_digests); i++) {
+        const struct tpm_const_digest *cd = &tpm_const_digests[i];
+        if (cd->length == length && !memcmp(cd->data, data, length)) {
+            tpm_hash_set_all(hctx, &cd->digests);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Return the digest calculated with the given hash algorithm or NULL
+static const u8 *
+tpm_hash_digest(struct tpm_hash_ctx *hctx, u16 hashalg)
+{
+    struct tpm_hash_bank *b = tpm_hash_find_bank(hctx, hashalg);
+    return b ? b->hash : NULL;
+}
+
 /*
- * Build the TPM2 tpm2_digest_values data structure from the given hash.
- * Follow the PCR bank configuration of the TPM and write the same hash
- * in either truncated or zero-padded form in the areas of all the other
- * hashes. For example, write the sha1 hash in the area of the sha256
- * hash and fill the remaining bytes with zeros. Or truncate the sha256
- * hash when writing it in the area of the sha1 hash.
+ * Build the TPM2 tpm2_digest_values data structure from the given
+ * digests. Follow the PCR bank configuration of the TPM and write the
+ * digest calculated with each bank's hash algorithm into that bank's
+ * area. Banks whose hash algorithm is not implemented receive the sha1
+ * hash in either truncated or zero-padded form.
  *
  * le: the log entry to build the digest in
- * sha1: the sha1 hash value to use
+ * hctx: the digests of the measured data
  * bigEndian: whether to build in big endian format for the TPM or
  *            little endian for the log
  *
  * Returns the digest size; -1 on fatal error
  */
 static int
-tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
+tpm20_build_digest(struct tpm_log_entry *le, struct tpm_hash_ctx *hctx
+                   , int bigEndian)
 {
     if (!tpm20_pcr_selection)
         return -1;
@@ -300,8 +694,14 @@ tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
         else
             v->hashAlg = be16_to_cpu(sel->hashAlg);
 
-        memset(v->hash, 0, hsize);
-        memcpy(v->hash, sha1, hsize > SHA1_BUFSIZE ? SHA1_BUFSIZE : hsize);
+        const u8 *hash = tpm_hash_digest(hctx, be16_to_cpu(sel->hashAlg));
+        if (hash) {
+            memcpy(v->hash, hash, hsize);
+        } else {
+            hash = tpm_hash_digest(hctx, TPM2_ALG_SHA1);
+            memset(v->hash, 0, hsize);
+            memcpy(v->hash, hash, hsize > SHA1_BUFSIZE ? SHA1_BUFSIZE : hsize);
+        }
 
         dest += sizeof(*v) + hsize;
         sel = nsel;
@@ -322,21 +722,23 @@ tpm20_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
 }
 
 static int
-tpm12_build_digest(struct tpm_log_entry *le, const u8 *sha1)
+tpm12_build_digest(struct tpm_log_entry *le, struct tpm_hash_ctx *hctx)
 {
     // On TPM 1.2 the digest contains just the SHA1 hash
-    memcpy(le->hdr.digest, sha1, SHA1_BUFSIZE);
+    memcpy(le->hdr.digest, tpm_hash_digest(hctx, TPM2_ALG_SHA1)
+           , SHA1_BUFSIZE);
     return SHA1_BUFSIZE;
 }
 
 static int
-tpm_build_digest(struct tpm_log_entry *le, const u8 *sha1, int bigEndian)
+tpm_build_digest(struct tpm_log_entry *le, struct tpm_hash_ctx *hctx
+                 , int bigEndian)
 {
     switch (TPM_version) {
     case TPM_VERSION_1_2:
-        return tpm12_build_digest(le, sha1);
+        return tpm12_build_digest(le, hctx);
     case TPM_VERSION_2:
-        return tpm20_build_digest(le, sha1, bigEndian);
+        return tpm20_build_digest(le, hctx, bigEndian);
     }
     return -1;
 }
@@ -524,6 +926,77 @@ tpm20_set_timeouts(void)
     tpmhw_set_timeouts(timeouts, durations);
 }
 
+/*
+ * Return the result of the TPM 2 self test; TPM2_RC_TESTING while the
+ * test is still running, -1 on error
+ */
+static int
+tpm20_gettestresult(void)
+{
+    struct tpm_req_header trgtr = {
+        .tag = cpu_to_be16(TPM2_ST_NO_SESSIONS),
+        .totlen = cpu_to_be32(sizeof(trgtr)),
+        .ordinal = cpu_to_be32(TPM2_CC_GetTestResult),
+    };
+    u8 buffer[128];
+    struct tpm_rsp_header *rsp = (void*)buffer;
+    u32 resp_length = sizeof(buffer);
+
+    int ret = tpmhw_transmit(0, &trgtr, buffer, &resp_length,
+                             TPM_DURATION_TYPE_SHORT);
+    if (ret || resp_length < sizeof(*rsp) + sizeof(u16) || rsp->errcode)
+        return -1;
+
+    /* the test result follows the vendor specific outData */
+    u32 offset = sizeof(*rsp) + sizeof(u16)
+                 + be16_to_cpu(*(u16*)&buffer[sizeof(*rsp)]);
+    if (offset + sizeof(u32) > resp_length)
+        return -1;
+
+    return be32_to_cpu(*(u32*)&buffer[offset]);
+}
+
+// A TPM 2 self test is running in the background
+static u8 TPM2_selftest_pending, TPM2_selftest_polling;
+// Only send TPM2_Startup(SU_STATE) on S3 resume, set during POST
+static u8 TPM2_fast_resume;
+
+#define TPM2_SELFTEST_POLL_MS 5
+
+/*
+ * Wait for a self test of the TPM 2 that runs in the background to
+ * complete. Returns non-zero if the self test failed.
+ */
+static int
+tpm20_selftest_wait(void)
+{
+    while (TPM2_selftest_polling)
+        // another thread is waiting for the result
+        yield();
+    if (!TPM2_selftest_pending)
+        return 0;
+
+    TPM2_selftest_polling = 1;
+    u32 end = timer_calc_usec(TPM2_DEFAULT_DURATION_LONG);
+    int ret;
+    for (;;) {
+        ret = tpm20_gettestresult();
+        if (ret != TPM2_RC_TESTING)
+            break;
+        if (timer_check(end)) {
+            warn_timeout();
+            break;
+        }
+        msleep(TPM2_SELFTEST_POLL_MS);
+    }
+    TPM2_selftest_pending = TPM2_selftest_polling = 0;
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Result of the TPM2 self test = 0x%08x\n",
+            ret);
+
+    return ret ? -1 : 0;
+}
+
 static int
 tpm12_extend(struct tpm_log_entry *le, int digest_len)
 {
@@ -547,35 +1020,32 @@ tpm12_extend(struct tpm_log_entry *le, int digest_len)
 
 static int tpm20_extend(struct tpm_log_entry *le, int digest_len)
 {
-    struct tpm2_req_extend tmp_tre = {
-        .hdr.tag     = cpu_to_be16(TPM2_ST_SESSIONS),
-        .hdr.totlen  = cpu_to_be32(0),
-        .hdr.ordinal = cpu_to_be32(TPM2_CC_PCR_Extend),
-        .pcrindex    = cpu_to_be32(le->hdr.pcrindex),
-        .authblocksize = cpu_to_be32(sizeof(tmp_tre.authblock)),
-        .authblock = {
-            .handle = cpu_to_be32(TPM2_RS_PW),
-            .noncesize = cpu_to_be16(0),
-            .contsession = TPM2_YES,
-            .pwdsize = cpu_to_be16(0),
-        },
-    };
-    u8 buffer[sizeof(tmp_tre) + sizeof(le->pad)];
-    struct tpm2_req_extend *tre = (struct tpm2_req_extend *)buffer;
-
-    memcpy(tre, &tmp_tre, sizeof(tmp_tre));
+    // Build the command where it is sent from, the CRB command buffer
+    // if it fits there
+    u8 buffer[sizeof(struct tpm2_req_extend) + sizeof(le->pad)];
+    struct tpm2_req_extend *tre = tpmhw_cmd_begin(
+        buffer, sizeof(*tre) + digest_len);
+
+    tre->hdr.tag = cpu_to_be16(TPM2_ST_SESSIONS);
+    tre->hdr.totlen = cpu_to_be32(sizeof(*tre) + digest_len);
+    tre->hdr.ordinal = cpu_to_be32(TPM2_CC_PCR_Extend);
+    tre->pcrindex = cpu_to_be32(le->hdr.pcrindex);
+    tre->authblocksize = cpu_to_be32(sizeof(tre->authblock));
+    tre->authblock.handle = cpu_to_be32(TPM2_RS_PW);
+    tre->authblock.noncesize = cpu_to_be16(0);
+    tre->authblock.contsession = TPM2_YES;
+    tre->authblock.pwdsize = cpu_to_be16(0);
     memcpy(&tre->digest[0], le->hdr.digest, digest_len);
 
-    tre->hdr.totlen = cpu_to_be32(sizeof(tmp_tre) + digest_len);
-
-    struct tpm_rsp_header rsp;
-    u32 resp_length = sizeof(rsp);
-    int ret = tpmhw_transmit(0, &tre->hdr, &rsp, &resp_length,
-                             TPM_DURATION_TYPE_SHORT);
-    if (ret || resp_length != sizeof(rsp) || rsp.errcode)
-        return -1;
+    struct tpm_rsp_header rsp_buffer, *rsp;
+    u32 resp_length = sizeof(rsp_buffer);
+    int ret = tpmhw_cmd_transmit(0, &tre->hdr, &rsp_buffer, &resp_length,
+                                 (void**)&rsp, TPM_DURATION_TYPE_SHORT);
+    if (ret || resp_length < sizeof(*rsp) || rsp->errcode)
+        ret = -1;
+    tpmhw_cmd_end();
 
-    return 0;
+    return ret;
 }
 
 static int
@@ -585,6 +1055,8 @@ tpm_extend(struct tpm_log_entry *le, int digest_len)
     case TPM_VERSION_1_2:
         return tpm12_extend(le, digest_len);
     case TPM_VERSION_2:
+        if (tpm20_selftest_wait())
+            return -1;
         return tpm20_extend(le, digest_len);
     }
     return -1;
@@ -616,28 +1088,41 @@ tpm20_stirrandom(void)
     return ret;
 }
 
+// Request up to buf_len random bytes from the TPM; returns the number
+// of bytes received (the TPM may return fewer) or -1 on error.
 static int
 tpm20_getrandom(u8 *buf, u16 buf_len)
 {
-    struct tpm2_res_getrandom rsp;
+    struct tpm2_res_getrandom rsp_buffer, *rsp;
 
-    if (buf_len > sizeof(rsp.rnd.buffer))
-        return -1;
+    if (buf_len > sizeof(rsp_buffer.rnd.buffer))
+        buf_len = sizeof(rsp_buffer.rnd.buffer);
 
-    struct tpm2_req_getrandom trgr = {
-        .hdr.tag = cpu_to_be16(TPM2_ST_NO_SESSIONS),
-        .hdr.totlen = cpu_to_be32(sizeof(trgr)),
-        .hdr.ordinal = cpu_to_be32(TPM2_CC_GetRandom),
-        .bytesRequested = cpu_to_be16(buf_len),
-    };
-    u32 resp_length = sizeof(rsp);
+    struct tpm2_req_getrandom trgr_buffer;
+    struct tpm2_req_getrandom *trgr = tpmhw_cmd_begin(&trgr_buffer,
+                                                      sizeof(trgr_buffer));
+    trgr->hdr.tag = cpu_to_be16(TPM2_ST_NO_SESSIONS);
+    trgr->hdr.totlen = cpu_to_be32(sizeof(*trgr));
+    trgr->hdr.ordinal = cpu_to_be32(TPM2_CC_GetRandom);
+    trgr->bytesRequested = cpu_to_be16(buf_len);
 
-    int ret = tpmhw_transmit(0, &trgr.hdr, &rsp, &resp_length,
-                             TPM_DURATION_TYPE_MEDIUM);
-    if (ret || resp_length != sizeof(rsp) || rsp.hdr.errcode)
+    u32 resp_length = sizeof(rsp_buffer);
+    int ret = tpmhw_cmd_transmit(0, &trgr->hdr, &rsp_buffer, &resp_length,
+                                 (void**)&rsp, TPM_DURATION_TYPE_MEDIUM);
+    if (ret || resp_length < offsetof(struct tpm2_res_getrandom, rnd.buffer)
+        || rsp->hdr.errcode) {
         ret = -1;
-    else
-        memcpy(buf, rsp.rnd.buffer, buf_len);
+    } else {
+        u16 size = be16_to_cpu(rsp->rnd.size);
+        if (size > buf_len || resp_length != (offsetof(struct tpm2_res_getrandom
+                                                       , rnd.buffer) + size)) {
+            ret = -1;
+        } else {
+            memcpy(buf, rsp->rnd.buffer, size);
+            ret = size;
+        }
+    }
+    tpmhw_cmd_end();
 
     dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_GetRandom = 0x%08x\n",
             ret);
@@ -747,6 +1232,138 @@ tpm_set_failure(void)
     TPM_working = 0;
 }
 
+
+/****************************************************************
+ * Queued PCR extends
+ ****************************************************************/
+
+// While queueing is enabled during POST, PCR extends are sent to the TPM
+// from a thread, so that waiting for the TPM to process them overlaps
+// with hardware init. The events are logged right away and the extends
+// are sent in the same order. If an extend fails, its event and all
+// events logged after it are removed from the log again, so the log
+// only holds events that were extended.
+struct tpm_extend_req {
+    struct tpm_extend_req *next;
+    int digest_len;
+    struct tpm_log_mark mark;
+    struct tpm_log_entry le;
+};
+
+static struct tpm_extend_req *ExtendQueue, *ExtendQueueTail;
+static int ExtendQueueing, ExtendThreadRunning;
+
+static void
+tpm_extend_thread(void *data)
+{
+    while (ExtendQueue) {
+        struct tpm_extend_req *req = ExtendQueue;
+        if (tpm_is_working() && tpm_extend(&req->le, req->digest_len)) {
+            tpm_set_failure();
+            tpm_log_rewind(&req->mark);
+        }
+        ExtendQueue = req->next;
+        if (!ExtendQueue)
+            ExtendQueueTail = NULL;
+        free(req);
+    }
+    ExtendThreadRunning = 0;
+}
+
+// Wait until all queued PCR extends have been sent to the TPM
+static void
+tpm_extend_flush(void)
+{
+    while (ExtendThreadRunning)
+        yield();
+}
+
+// Queue a PCR extend for the extend thread. Only called during POST.
+int VISIBLE32INIT
+tpm_extend_queue(struct tpm_log_entry *le, int digest_len)
+{
+    struct tpm_extend_req *req = malloc_tmp(sizeof(*req));
+    if (!req) {
+        warn_noalloc();
+        tpm_extend_flush();
+        return tpm_extend(le, digest_len);
+    }
+    req->next = NULL;
+    req->digest_len = digest_len;
+    tpm_log_mark(&req->mark);
+    memcpy(&req->le, le, sizeof(req->le));
+    if (ExtendQueueTail)
+        ExtendQueueTail->next = req;
+    else
+        ExtendQueue = req;
+    ExtendQueueTail = req;
+
+    if (!ExtendThreadRunning) {
+        ExtendThreadRunning = 1;
+        run_thread(tpm_extend_thread, NULL);
+    }
+    return 0;
+}
+
+// Extend the PCR with the digest in 'le', or queue the extend if
+// queueing is enabled. Returns non-zero if the extend failed.
+static int
+tpm_extend_queued(struct tpm_log_entry *le, int digest_len)
+{
+    if (ExtendQueueing)
+        return tpm_extend_queue(le, digest_len);
+    return tpm_extend(le, digest_len);
+}
+
+// Extend the PCR with the final digests in 'hctx' and log the event
+static void
+tpm_add_measurement_digests(u32 pcrindex, u32 event_type,
+                            const char *event, u32 event_length,
+                            struct tpm_hash_ctx *hctx)
+{
+    struct tpm_log_entry le = {
+        .hdr.pcrindex = pcrindex,
+        .hdr.eventtype = event_type,
+    };
+    int digest_len = tpm_build_digest(&le, hctx, 1);
+    if (digest_len < 0)
+        return;
+    int ret = tpm_extend_queued(&le, digest_len);
+    if (ret) {
+        tpm_set_failure();
+        return;
+    }
+    if (!tpm_is_working())
+        // The extend thread already ran and failed
+        return;
+    tpm_build_digest(&le, hctx, 0);
+    tpm_log_event(&le.hdr, digest_len, event, event_length);
+}
+
+/*
+ * Add a measurement of data that was hashed with tpm_hash_init() and
+ * tpm_hash_update() to the log
+ *
+ * Input parameters:
+ *  pcrindex   : which PCR to extend
+ *  event_type : type of event; specs section on 'Event Types'
+ *  event       : pointer to info (e.g., string) to be added to log as-is
+ *  event_length: length of the event
+ *  hctx        : the hash context the measured data was added to
+ */
+static void
+tpm_add_measurement_hashed(u32 pcrindex, u32 event_type,
+                           const char *event, u32 event_length,
+                           struct tpm_hash_ctx *hctx)
+{
+    if (!tpm_is_working())
+        return;
+
+    tpm_hash_final(hctx);
+    tpm_add_measurement_digests(pcrindex, event_type, event, event_length
+                                , hctx);
+}
+
 /*
  * Add a measurement to the log; the data at data_seg:data/length are
  * appended to the TCG_PCClientPCREventStruct
@@ -767,23 +1384,14 @@ tpm_add_measurement_to_log(u32 pcrindex, u32 event_type,
     if (!tpm_is_working())
         return;
 
-    u8 hash[SHA1_BUFSIZE];
-    sha1(hashdata, hashdata_length, hash);
-
-    struct tpm_log_entry le = {
-        .hdr.pcrindex = pcrindex,
-        .hdr.eventtype = event_type,
-    };
-    int digest_len = tpm_build_digest(&le, hash, 1);
-    if (digest_len < 0)
-        return;
-    int ret = tpm_extend(&le, digest_len);
-    if (ret) {
-        tpm_set_failure();
-        return;
+    struct tpm_hash_ctx hctx;
+    if (tpm_hash_set_const(&hctx, hashdata, hashdata_length)) {
+        tpm_hash_init(&hctx);
+        tpm_hash_update(&hctx, hashdata, hashdata_length);
+        tpm_hash_final(&hctx);
     }
-    tpm_build_digest(&le, hash, 0);
-    tpm_log_event(&le.hdr, digest_len, event, event_length);
+    tpm_add_measurement_digests(pcrindex, event_type, event, event_length
+                                , &hctx);
 }
 
 // Add an EV_ACTION measurement to the list of measurements
@@ -832,6 +1440,79 @@ tpm_smbios_measure(void)
                                (u8 *)&pcctes, sizeof(pcctes));
 }
 
+// Measurements of ACPI tables. The tables are hashed while they are
+// placed, which happens before the TPM is set up and its PCR banks are
+// known, so the digests of all hash algorithms are kept until then.
+struct tpm_acpi_table {
+    struct tpm_acpi_table *next;
+    u32 signature;
+    struct tpm_digests digests;
+};
+static struct tpm_acpi_table *AcpiTables, *AcpiTablesTail;
+static u8 TPM_probed;
+
+// Detect the TPM hardware; may be called before tpm_setup()
+static TPMVersion
+tpm_probe(void)
+{
+    if (!TPM_probed) {
+        TPM_probed = 1;
+        TPM_version = tpmhw_probe();
+    }
+    return TPM_version;
+}
+
+// Hash an ACPI table in its final form for a later measurement
+void
+tpm_add_acpi_table(const struct acpi_table_header *table)
+{
+    if (!CONFIG_TCGBIOS || tpm_probe() == TPM_VERSION_NONE)
+        return;
+    if (table->signature == TCPA_SIGNATURE
+        || table->signature == TPM2_SIGNATURE)
+        // These point to the event log and change with it
+        return;
+
+    struct tpm_acpi_table *t = malloc_tmp(sizeof(*t));
+    if (!t) {
+        warn_noalloc();
+        return;
+    }
+    struct tpm_hash_ctx hctx;
+    tpm_hash_init_all(&hctx);
+    tpm_hash_update(&hctx, table, le32_to_cpu(table->length));
+    tpm_hash_final(&hctx);
+    tpm_hash_save_all(&hctx, &t->digests);
+    t->signature = table->signature;
+    t->next = NULL;
+    if (AcpiTables)
+        AcpiTablesTail->next = t;
+    else
+        AcpiTables = t;
+    AcpiTablesTail = t;
+}
+
+static void
+tpm_acpi_measure(void)
+{
+    static const char event[] = "ACPI DATA";
+    struct tpm_acpi_table *t = AcpiTables;
+    AcpiTables = NULL;
+    while (t) {
+        struct tpm_acpi_table *next = t->next;
+        if (tpm_is_working()) {
+            dprintf(DEBUG_tcg, "TCGBIOS: Measuring ACPI table %.4s\n"
+                    , (char*)&t->signature);
+            struct tpm_hash_ctx hctx;
+            tpm_hash_set_all(&hctx, &t->digests);
+            tpm_add_measurement_digests(1, EV_POST_CODE, event
+                                        , sizeof(event) - 1, &hctx);
+        }
+        free(t);
+        t = next;
+    }
+}
+
 static int
 tpm12_assert_physical_presence(void)
 {
@@ -904,6 +1585,13 @@ err_exit:
     return -1;
 }
 
+static void
+tpm20_selftest_thread(void *data)
+{
+    if (tpm20_selftest_wait())
+        tpm_set_failure();
+}
+
 static int
 tpm20_startup(void)
 {
@@ -924,8 +1612,26 @@ tpm20_startup(void)
     if (ret)
         goto err_exit;
 
-    ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
-                         1, TPM2_YES, TPM_DURATION_TYPE_LONG);
+    TPM2_fast_resume = romfile_loadint("etc/tpm2-fast-resume", 0);
+
+    if (romfile_loadint("etc/tpm2-deferred-selftest", 0)) {
+        /*
+         * Only test what was not tested yet and let the TPM run the tests
+         * in the background; the result is checked before the first
+         * command that needs the tested functions
+         */
+        ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
+                             1, TPM2_NO, TPM_DURATION_TYPE_SHORT);
+        if (ret == TPM2_RC_TESTING)
+            ret = 0;
+        if (!ret) {
+            TPM2_selftest_pending = 1;
+            run_thread(tpm20_selftest_thread, NULL);
+        }
+    } else {
+        ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
+                             1, TPM2_YES, TPM_DURATION_TYPE_LONG);
+    }
 
     dprintf(DEBUG_tcg, "TCGBIOS: Return value from sending TPM2_CC_SelfTest = 0x%08x\n",
             ret);
@@ -962,13 +1668,114 @@ tpm_startup(void)
     return -1;
 }
 
+
+/****************************************************************
+ * Entropy pool
+ ****************************************************************/
+
+// Random bytes for the firmware.  The pool is filled with bulk
+// TPM2_GetRandom requests mixed with the output of the RDSEED/RDRAND
+// instructions; handed out bytes are cleared.
+#define TPM_ENTROPY_POOL_SIZE 64
+
+static u8 EntropyPool[TPM_ENTROPY_POOL_SIZE];
+static u8 EntropyPoolAvail;
+static u8 CPU_has_rdrand, CPU_has_rdseed;
+
+static void
+tpm_entropy_setup(void)
+{
+    u32 eax, ebx, ecx, edx, max;
+    cpuid(0, &max, &ebx, &ecx, &edx);
+    if (max < 1)
+        return;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    CPU_has_rdrand = !!(ecx & CPUID_ECX_RDRAND);
+    if (max >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        CPU_has_rdseed = !!(ebx & CPUID_7_EBX_RDSEED);
+    }
+}
+
+// Get a 32bit random value from the cpu; returns 0 on failure
+static int
+cpu_random(u32 *val)
+{
+    int i;
+    u8 ok;
+    for (i = 0; CPU_has_rdseed && i < 10; i++) {
+        asm volatile("rdseed %0 ; setc %1" : "=r"(*val), "=qm"(ok));
+        if (ok)
+            return 1;
+    }
+    for (i = 0; CPU_has_rdrand && i < 10; i++) {
+        asm volatile("rdrand %0 ; setc %1" : "=r"(*val), "=qm"(ok));
+        if (ok)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+tpm_entropy_refill(void)
+{
+    memset(EntropyPool, 0, sizeof(EntropyPool));
+
+    u32 tpm_filled = 0;
+    while (TPM_version == TPM_VERSION_2 && tpm_is_working()
+           && tpm_filled < sizeof(EntropyPool)) {
+        int ret = tpm20_getrandom(&EntropyPool[tpm_filled]
+                                  , sizeof(EntropyPool) - tpm_filled);
+        if (ret <= 0)
+            break;
+        tpm_filled += ret;
+    }
+
+    u32 cpu_filled = 0;
+    while (cpu_filled < sizeof(EntropyPool)) {
+        u32 val;
+        if (!cpu_random(&val))
+            break;
+        u32 *p = (void*)&EntropyPool[cpu_filled];
+        *p ^= val;
+        cpu_filled += sizeof(val);
+    }
+
+    dprintf(DEBUG_tcg, "TCGBIOS: Entropy pool refilled (tpm %d, cpu %d)\n"
+            , tpm_filled, cpu_filled);
+
+    if (tpm_filled < sizeof(EntropyPool) && cpu_filled < sizeof(EntropyPool)) {
+        memset(EntropyPool, 0, sizeof(EntropyPool));
+        return -1;
+    }
+    EntropyPoolAvail = sizeof(EntropyPool);
+    return 0;
+}
+
+static int
+tpm_entropy_get(u8 *buf, u32 len)
+{
+    while (len) {
+        if (!EntropyPoolAvail && tpm_entropy_refill())
+            return -1;
+        u32 count = len < EntropyPoolAvail ? len : EntropyPoolAvail;
+        u8 *src = &EntropyPool[sizeof(EntropyPool) - EntropyPoolAvail];
+        memcpy(buf, src, count);
+        memset(src, 0, count);
+        EntropyPoolAvail -= count;
+        buf += count;
+        len -= count;
+    }
+    return 0;
+}
+
 void
 tpm_setup(void)
 {
     if (!CONFIG_TCGBIOS)
         return;
 
-    TPM_version = tpmhw_probe();
+    tpm_probe();
     if (TPM_version == TPM_VERSION_NONE)
         return;
 
@@ -976,6 +1783,9 @@ tpm_setup(void)
             "TCGBIOS: Detected a TPM %s.\n",
              (TPM_version == TPM_VERSION_1_2) ? "1.2" : "2");
 
+    sha_setup();
+    tpm_entropy_setup();
+
     int ret = tpm_tpm2_probe();
     if (ret) {
         ret = tpm_tcpa_probe();
@@ -988,27 +1798,38 @@ tpm_setup(void)
     if (runningOnXen())
         return;
 
+    tpmhw_set_irq(romfile_loadint("etc/tpm-irq", 0));
+
     ret = tpm_startup();
     if (ret)
         return;
 
+    // Let the TPM process the POST measurements in the background
+    ExtendQueueing = 1;
+
     tpm_smbios_measure();
+    tpm_acpi_measure();
     tpm_add_action(2, "Start Option ROM Scan");
 }
 
 static void
 tpm20_prepboot(void)
 {
-    int ret = tpm20_stirrandom();
+    int ret = tpm20_selftest_wait();
+    if (ret)
+         goto err_exit;
+
+    ret = tpm20_stirrandom();
     if (ret)
          goto err_exit;
 
     u8 auth[20];
-    ret = tpm20_getrandom(&auth[0], sizeof(auth));
+    ret = tpm_entropy_get(&auth[0], sizeof(auth));
     if (ret)
         goto err_exit;
 
     ret = tpm20_hierarchychangeauth(auth);
+    memset(auth, 0, sizeof(auth));
     if (ret)
         goto err_exit;
 
@@ -1026,6 +1847,11 @@ tpm_prepboot(void)
     if (!CONFIG_TCGBIOS)
         return;
 
+    // All queued measurements must be in the PCRs before the separators
+    ExtendQueueing = 0;
+    wait_threads();
+    tpm_extend_flush();
+
     switch (TPM_version) {
     case TPM_VERSION_1_2:
         if (TPM_has_physical_presence)
@@ -1039,6 +1865,20 @@ tpm_prepboot(void)
 
     tpm_add_action(4, "Calling INT 19h");
     tpm_add_event_separators();
+    tpmhw_publish_stats();
+
+    // The OS owns the irqs from now on
+    tpmhw_set_irq(0);
+
+    if (!tpm_is_working())
+        return;
+
+    dprintf(DEBUG_tcg_stats, "TCGBIOS: Log at %p uses %u of %u bytes"
+            " (high-water mark %u bytes, %u entries dropped)\n",
+            tpm_state.log_area_start_address,
+            tpm_state.log_area_next_entry - tpm_state.log_area_start_address,
+            tpm_state.log_area_minimum_length,
+            tpm_state.log_area_high_water, tpm_state.entries_dropped);
 }
 
 /*
@@ -1046,6 +1886,29 @@ tpm_prepboot(void)
  */
 void
 tpm_option_rom(const void *addr, u32 len)
+{
+    struct tpm_hash_ctx hctx;
+    if (tpm_option_rom_start(&hctx))
+        return;
+    tpm_hash_update(&hctx, addr, len);
+    tpm_option_rom_hashed(&hctx);
+}
+
+// Prepare to measure an option rom while it is being copied. Returns
+// non-zero if the option rom does not need to be measured.
+int
+tpm_option_rom_start(struct tpm_hash_ctx *hctx)
+{
+    tpm_hash_reset(hctx);
+    if (!tpm_is_working())
+        return -1;
+    tpm_hash_add_bank(hctx, TPM2_ALG_SHA1);
+    return 0;
+}
+
+// Measure an option rom that was added to 'hctx' with tpm_hash_update()
+void
+tpm_option_rom_hashed(struct tpm_hash_ctx *hctx)
 {
     if (!tpm_is_working())
         return;
@@ -1054,13 +1917,35 @@ tpm_option_rom(const void *addr, u32 len)
         .eventid = 7,
         .eventdatasize = sizeof(u16) + sizeof(u16) + SHA1_BUFSIZE,
     };
-    sha1((const u8 *)addr, len, pcctes.digest);
+    tpm_hash_final(hctx);
+    memcpy(pcctes.digest, tpm_hash_digest(hctx, TPM2_ALG_SHA1), SHA1_BUFSIZE);
     tpm_add_measurement_to_log(2,
                                EV_EVENT_TAG,
                                (const char *)&pcctes, sizeof(pcctes),
                                (u8 *)&pcctes, sizeof(pcctes));
 }
 
+// Prepare to measure data that is added to 'hctx' with
+// tpm_hash_update() while it is being loaded. Returns non-zero if the
+// data does not need to be measured.
+int
+tpm_measure_start(struct tpm_hash_ctx *hctx)
+{
+    tpm_hash_reset(hctx);
+    if (!tpm_is_working())
+        return -1;
+    tpm_hash_init(hctx);
+    return 0;
+}
+
+// Add an EV_IPL measurement of the data hashed into 'hctx'
+void
+tpm_add_ipl_hashed(u32 pcrindex, const char *event, u32 event_length
+                   , struct tpm_hash_ctx *hctx)
+{
+    tpm_add_measurement_hashed(pcrindex, EV_IPL, event, event_length, hctx);
+}
+
 void
 tpm_add_bcv(u32 bootdrv, const u8 *addr, u32 length)
 {
@@ -1144,6 +2029,9 @@ tpm_s3_resume(void)
         if (ret)
             goto err_exit;
 
+        if (TPM2_fast_resume)
+            /* the TPM tests the functions it needs on demand */
+            break;
 
         ret = tpm_simple_cmd(0, TPM2_CC_SelfTest,
                              1, TPM2_YES, TPM_DURATION_TYPE_LONG);
@@ -1182,32 +2070,61 @@ static inline void *output_buf32(struct bregs *regs)
     return MAKE_FLATPTR(regs->ds, regs->si);
 }
 
+// Size of the digests of a hash algorithm the firmware implements
+static int
+tpm_hash_size(u16 hashalg)
+{
+    const struct hash_parameters *hp = tpm20_find_by_hashalg(hashalg);
+    if (!hp || hashalg == TPM2_ALG_SM3_256)
+        return -1;
+    return hp->hash_buffersize;
+}
+
+// Hash, log and optionally extend an event; the 'hashalg' digest of the
+// hashed data is stored in 'digest' if that is given.
 static u32
 hash_log_extend(struct pcpes *pcpes, const void *hashdata, u32 hashdata_length
-                , void *event, int extend)
+                , void *event, int extend, u16 hashalg, u8 *digest)
 {
     if (pcpes->pcrindex >= 24)
         return TCG_INVALID_INPUT_PARA;
-    if (hashdata)
-        sha1(hashdata, hashdata_length, pcpes->digest);
+
+    struct tpm_hash_ctx hctx;
+    if (hashdata) {
+        tpm_hash_init(&hctx);
+        tpm_hash_add_bank(&hctx, hashalg);
+        tpm_hash_update(&hctx, hashdata, hashdata_length);
+        tpm_hash_final(&hctx);
+        memcpy(pcpes->digest, tpm_hash_digest(&hctx, TPM2_ALG_SHA1)
+               , sizeof(pcpes->digest));
+    } else {
+        tpm_hash_set_sha1(&hctx, pcpes->digest);
+    }
+    const u8 *hash = tpm_hash_digest(&hctx, hashalg);
+    if (!hash)
+        return TCG_INVALID_INPUT_PARA;
 
     struct tpm_log_entry le = {
         .hdr.pcrindex = pcpes->pcrindex,
         .hdr.eventtype = pcpes->eventtype,
     };
-    int digest_len = tpm_build_digest(&le, pcpes->digest, 1);
+    int digest_len = tpm_build_digest(&le, &hctx, 1);
     if (digest_len < 0)
         return TCG_GENERAL_ERROR;
     if (extend) {
+        // Keep the PCRs in the order of the log
+        tpm_extend_flush();
         int ret = tpm_extend(&le, digest_len);
         if (ret)
             return TCG_TCG_COMMAND_ERROR;
     }
-    tpm_build_digest(&le, pcpes->digest, 0);
+    tpm_build_digest(&le, &hctx, 0);
     int ret = tpm_log_event(&le.hdr, digest_len
                             , pcpes->event, pcpes->eventdatasize);
     if (ret)
         return TCG_PC_LOGOVERFLOW;
+    if (digest)
+        memcpy(digest, hash, tpm_hash_size(hashalg));
     return 0;
 }
 
@@ -1251,15 +2168,20 @@ hash_log_extend_event_int(const struct hleei_short *hleei_s,
         rc = TCG_INVALID_INPUT_PARA;
         goto err_exit;
     }
+    u16 hashalg = hleei_s->hashalg ?: TPM2_ALG_SHA1;
+    int hsize = tpm_hash_size(hashalg);
+    if (hsize < 0) {
+        rc = TCG_INVALID_INPUT_PARA;
+        goto err_exit;
+    }
     rc = hash_log_extend(pcpes, hleei_s->hashdataptr, hleei_s->hashdatalen
-                         , pcpes->event, 1);
+                         , pcpes->event, 1, hashalg, hleeo->digest);
     if (rc)
         goto err_exit;
 
-    hleeo->opblength = sizeof(struct hleeo);
+    hleeo->opblength = offsetof(struct hleeo, digest) + hsize;
     hleeo->reserved  = 0;
     hleeo->eventnumber = tpm_state.entry_count;
-    memcpy(hleeo->digest, pcpes->digest, sizeof(hleeo->digest));
 
 err_exit:
     if (rc != 0) {
@@ -1300,6 +2222,7 @@ pass_through_to_tpm_int(struct pttti *pttti, struct pttto *pttto)
         }
     }
 
+    tpm_extend_flush();
     u32 resbuflen = pttti->opblength - offsetof(struct pttto, tpmopout);
     int ret = tpmhw_transmit(0, trh, pttto->tpmopout, &resbuflen,
                              TPM_DURATION_TYPE_LONG /* worst case */);
@@ -1349,7 +2272,7 @@ hash_log_event_int(const struct hlei *hlei, struct hleo *hleo)
         goto err_exit;
     }
     rc = hash_log_extend(pcpes, hlei->hashdataptr, hlei->hashdatalen
-                         , pcpes->event, 0);
+                         , pcpes->event, 0, TPM2_ALG_SHA1, NULL);
     if (rc)
         goto err_exit;
 
@@ -1367,16 +2290,28 @@ err_exit:
     return rc;
 }
 
+// Hash with TPM_ALG_SHA (same id as TPM2_ALG_SHA1) or one of the TPM2
+// sha2 algorithms; the size of the digest is returned in 'hashsize'.
 static u32
-hash_all_int(const struct hai *hai, u8 *hash)
+hash_all_int(const struct hai *hai, u8 *hash, u32 *hashsize)
 {
     if (hai->ipblength != sizeof(struct hai) ||
         hai->hashdataptr == 0 ||
         hai->hashdatalen == 0 ||
-        hai->algorithmid != TPM_ALG_SHA)
+        hai->algorithmid > 0xffff)
+        return TCG_INVALID_INPUT_PARA;
+    u16 hashalg = hai->algorithmid;
+    int hsize = tpm_hash_size(hashalg);
+    if (hsize < 0)
         return TCG_INVALID_INPUT_PARA;
 
-    sha1((const u8 *)hai->hashdataptr, hai->hashdatalen, hash);
+    struct tpm_hash_ctx hctx;
+    tpm_hash_reset(&hctx);
+    tpm_hash_add_bank(&hctx, hashalg);
+    tpm_hash_update(&hctx, hai->hashdataptr, hai->hashdatalen);
+    tpm_hash_final(&hctx);
+    memcpy(hash, tpm_hash_digest(&hctx, hashalg), hsize);
+    *hashsize = hsize;
     return 0;
 }
 
@@ -1401,7 +2336,8 @@ compact_hash_log_extend_event_int(u8 *buffer,
         .eventtype     = EV_COMPACT_HASH,
         .eventdatasize = sizeof(info),
     };
-    u32 rc = hash_log_extend(&pcpes, buffer, length, &info, 1);
+    u32 rc = hash_log_extend(&pcpes, buffer, length, &info, 1
+                              , TPM2_ALG_SHA1, NULL);
     if (rc)
         return rc;
 
@@ -1460,11 +2396,13 @@ tpm_interrupt_handler32(struct bregs *regs)
                                        (struct hleo*)output_buf32(regs));
         break;
 
-    case TCG_HashAll:
-        regs->eax =
-            hash_all_int((struct hai*)input_buf32(regs),
-                          (u8 *)output_buf32(regs));
+    case TCG_HashAll: {
+        u32 hashsize = regs->ecx;
+        regs->eax = hash_all_int((struct hai*)input_buf32(regs),
+                                 (u8 *)output_buf32(regs), &hashsize);
+        regs->ecx = hashsize;
         break;
+    }
 
     case TCG_TSS:
         regs->eax = tss_int((struct ti*)input_buf32(regs),
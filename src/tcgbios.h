@@ -1,11 +1,45 @@
 #ifndef TCGBIOS_H
 #define TCGBIOS_H
 
+#include "sha.h" // struct sha1_ctx
 #include "types.h"
 
+struct acpi_table_header;
 struct bregs;
 void tpm_interrupt_handler32(struct bregs *regs);
 
+// The measured data is fed to all hash algorithms in strides of this
+// size (a multiple of all their block sizes), so that every algorithm
+// hashes a stride while it is still in the cache and the data is only
+// read from memory once.
+#define TPM_HASH_STRIDE 128
+
+// Streaming hash state for measuring data in all PCR banks in use. The
+// sha1 hash is always calculated since it is needed for TPM 1.2, for
+// the event data of some measurements and for banks without a hash
+// implementation.
+struct tpm_hash_ctx {
+    u32 total;
+    u32 limit;                  // data past this many bytes isn't hashed
+    int count;
+    struct tpm_hash_bank {
+        u16 hashalg;
+        union {
+            struct sha1_ctx sha1;
+            struct sha256_ctx sha256;
+            struct sha512_ctx sha512;
+            u8 hash[sizeof(struct sha512_ctx)];
+        };
+    } banks[4];
+    u8 buf[TPM_HASH_STRIDE];
+};
+void tpm_hash_init(struct tpm_hash_ctx *hctx);
+void tpm_hash_update(struct tpm_hash_ctx *hctx, const void *data, u32 length);
+
+// Data that is measured while it is being copied is copied in chunks of
+// this size, so that each chunk is hashed while it is still in the cache.
+#define TPM_HASH_CHUNK 4096
+
 void tpm_setup(void);
 void tpm_prepboot(void);
 void tpm_s3_resume(void);
@@ -13,6 +47,12 @@ void tpm_add_bcv(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom(u32 bootdrv, const u8 *addr, u32 length);
 void tpm_add_cdrom_catalog(const u8 *addr, u32 length);
 void tpm_option_rom(const void *addr, u32 len);
+int tpm_option_rom_start(struct tpm_hash_ctx *hctx);
+void tpm_option_rom_hashed(struct tpm_hash_ctx *hctx);
+int tpm_measure_start(struct tpm_hash_ctx *hctx);
+void tpm_add_ipl_hashed(u32 pcrindex, const char *event, u32 event_length
+                        , struct tpm_hash_ctx *hctx);
+void tpm_add_acpi_table(const struct acpi_table_header *table);
 int tpm_can_show_menu(void);
 void tpm_menu(void);
 
@@ -162,9 +162,11 @@ void sdcard_setup(void);
 // hw/timer.c
 void timer_setup(void);
 void pmtimer_setup(u16 ioport);
+u32 timer_read(void);
 u32 timer_calc(u32 msecs);
 u32 timer_calc_usec(u32 usecs);
 int timer_check(u32 end);
+u32 timer_to_usec(u32 time);
 void ndelay(u32 count);
 void udelay(u32 count);
 void mdelay(u32 count);